@@ -0,0 +1,94 @@
+#!/bin/sh
+# Check that port_forwarder holds CONNS concurrent connections on loopback.
+#
+#	./bench_100k.sh			100000 connections over 4 ports
+#	CONNS=8000 ./bench_100k.sh	smaller run where the hard limit is low
+#	PF_PORT=17000 ECHO_PORT=19000 ./bench_100k.sh	other ports
+#
+# Builds port_forwarder, epoll_client and echo_server into a temporary
+# directory and starts echo_server on ECHO_PORT.., port_forwarder on
+# PF_PORT.. with -n CONNS, then one epoll_client per port. Every second the forwarder is
+# sent SIGUSR1 and the pairs of all workers are added up. The run passes once
+# CONNS pairs are open at the same time with no refused connection, and fails
+# if that does not happen within TIMEOUT seconds.
+#
+# One client address reaches about 28k connections per destination port
+# (net.ipv4.ip_local_port_range), hence PORTS. The forwarder needs two
+# descriptors per pair, so the hard RLIMIT_NOFILE must be above 2 * CONNS;
+# the script tries to raise it, which takes root with CAP_SYS_RESOURCE.
+
+CONNS=${CONNS:-100000}
+PORTS=${PORTS:-4}
+ITERATIONS=${ITERATIONS:-1000}
+TIMEOUT=${TIMEOUT:-120}
+PF_PORT=${PF_PORT:-7000}
+ECHO_PORT=${ECHO_PORT:-9000}
+
+SRC=$(cd "$(dirname "$0")" && pwd)
+DIR=$(mktemp -d)
+PIDS=""
+trap 'kill $PIDS 2>/dev/null; wait 2>/dev/null; rm -rf "$DIR"' EXIT INT TERM
+
+NEED=$((2 * CONNS + 1024))
+ulimit -n $NEED 2>/dev/null
+if [ "$(ulimit -Hn)" != unlimited ] && [ "$(ulimit -Hn)" -lt $NEED ]; then
+	echo "Hard RLIMIT_NOFILE is $(ulimit -Hn), $CONNS connections need $NEED. Raise it or lower CONNS" >&2
+	exit 1
+fi
+
+gcc -O2 -o "$DIR/port_forwarder" "$SRC/port_forwarder.c" -lpthread || exit 1
+gcc -O2 -o "$DIR/epoll_client" "$SRC/epoll_client.c" -lpthread || exit 1
+gcc -O2 -o "$DIR/echo_server" "$SRC/echo_server.c" || exit 1
+
+echo "$PF_PORT-$((PF_PORT + PORTS - 1)),127.0.0.1,$ECHO_PORT-$((ECHO_PORT + PORTS - 1))" > "$DIR/bench.conf"
+
+"$DIR/echo_server" -p $ECHO_PORT -n $PORTS > "$DIR/echo.log" 2>&1 &
+ECHO=$!
+PIDS="$PIDS $ECHO"
+
+# The forwarder logs every read, only keep the reports. Through a FIFO
+# rather than a pipeline, so the trap knows the PID of both
+mkfifo "$DIR/pf.fifo" || exit 1
+grep --line-buffered -E '^(Worker [0-9]+:|Descriptors:|RLIMIT_NOFILE)' < "$DIR/pf.fifo" >> "$DIR/pf.log" &
+PIDS="$PIDS $!"
+"$DIR/port_forwarder" -f "$DIR/bench.conf" -n $CONNS > "$DIR/pf.fifo" 2>&1 &
+PF=$!
+PIDS="$PIDS $PF"
+sleep 1
+if ! kill -0 $PF 2>/dev/null || ! kill -0 $ECHO 2>/dev/null; then
+	echo "port_forwarder or echo_server did not start, are ports $PF_PORT and $ECHO_PORT free?" >&2
+	cat "$DIR/echo.log" >&2
+	exit 1
+fi
+
+p=0
+while [ $p -lt $PORTS ]; do
+	"$DIR/epoll_client" -h 127.0.0.1 -p $((PF_PORT + p)) -c $((CONNS / PORTS)) -d hello -i $ITERATIONS > /dev/null 2>&1 &
+	PIDS="$PIDS $!"
+	p=$((p + 1))
+done
+
+WANT=$((CONNS / PORTS * PORTS))
+PEAK=0
+t=0
+while [ $t -lt $TIMEOUT ]; do
+	sleep 1
+	t=$((t + 1))
+	: > "$DIR/pf.log"
+	kill -USR1 $PF || break
+	sleep 0.2
+	PAIRS=$(awk '/^Worker/ { n += $3 } END { print n + 0 }' "$DIR/pf.log")
+	REFUSED=$(awk '/^Worker/ { n += $(NF - 5) } END { print n + 0 }' "$DIR/pf.log")
+	FDS=$(awk '/^Descriptors:/ { print $2 }' "$DIR/pf.log")
+	[ "$PAIRS" -gt $PEAK ] && PEAK=$PAIRS
+	echo "${t}s: $PAIRS pairs, $REFUSED refused, $FDS descriptors"
+	[ "$REFUSED" -gt 0 ] && break
+	[ "$PAIRS" -ge $WANT ] && break
+done
+
+if [ $PEAK -ge $WANT ] && [ "$REFUSED" -eq 0 ]; then
+	echo "PASS: $PEAK concurrent pairs, no refused connection"
+	exit 0
+fi
+echo "FAIL: peak of $PEAK concurrent pairs out of $WANT, $REFUSED refused"
+exit 1
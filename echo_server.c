@@ -0,0 +1,186 @@
+/******************************************************************
+File: 		echo_server.c
+
+Usage:		./echo_server
+			-h <address>		Address to listen on (default 127.0.0.1)
+			-p <int_port>		First port to listen on (default 9000)
+			-n <int_ports>		Consecutive ports to listen on (default 1)
+
+		Single threaded, edge-triggered epoll echo server, the backend of
+		bench_100k.sh. Every byte read is sent back at once. It is meant
+		for lockstep clients such as epoll_client, which wait for each
+		message to come back: a connection whose send buffer is full is
+		closed rather than buffered.
+
+		The soft RLIMIT_NOFILE is raised to the hard limit.
+
+Date:		October 19, 2026
+
+Purpose:	Backend for the port_forwarder connection benchmark
+*******************************************************************/
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+
+#define BUFLEN 4096
+#define EPOLL_QUEUE_LEN 256
+#define MAX_PORTS 64
+#define LISTENER ((uint64_t)1 << 32) // Tags listeners in the epoll data
+
+static void SystemFatal(const char* message);
+static void raise_nofile(void);
+static int open_listener(struct in_addr * addr, int port);
+static void accept_all(int epoll_fd, int fd);
+static int echo(int fd);
+
+int main (int argc, char ** argv)
+{
+	char * host = "127.0.0.1";
+	int port = 9000, ports = 1, c, i, epoll_fd, num_fds, fd;
+	struct in_addr addr;
+	struct epoll_event event, events[EPOLL_QUEUE_LEN];
+
+	while((c = getopt(argc, argv, "h:p:n:")) != -1)
+	{
+		switch(c)
+		{
+			case 'h':
+			host = optarg;
+			break;
+			case 'p':
+			port = atoi(optarg);
+			break;
+			case 'n':
+			ports = atoi(optarg);
+			break;
+			default:
+			fprintf(stderr, "Usage: %s [-h address] [-p port] [-n ports]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(inet_aton(host, &addr) == 0 || port < 1 || ports < 1 || ports > MAX_PORTS || port + ports > 65536)
+	{
+		fprintf(stderr, "Invalid address or ports, at most %d ports\n", MAX_PORTS);
+		exit(EXIT_FAILURE);
+	}
+	raise_nofile();
+
+	if((epoll_fd = epoll_create1(0)) == -1)
+		SystemFatal("epoll_create");
+	for(i = 0; i < ports; i++){
+		fd = open_listener(&addr, port + i);
+		event.events = EPOLLIN | EPOLLET;
+		event.data.u64 = LISTENER | fd;
+		if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+			SystemFatal("epoll_ctl");
+	}
+	printf("Echoing on %s:%d-%d\n", host, port, port + ports - 1);
+	fflush(stdout);
+
+	while(1){
+		if((num_fds = epoll_wait(epoll_fd, events, EPOLL_QUEUE_LEN, -1)) == -1){
+			if(errno == EINTR)
+				continue;
+			SystemFatal("epoll_wait");
+		}
+
+		for(i = 0; i < num_fds; i++){
+			fd = (int)(uint32_t)events[i].data.u64;
+
+			if(events[i].data.u64 & LISTENER)
+				accept_all(epoll_fd, fd);
+			// Closing the socket also removes it from epoll
+			else if((events[i].events & (EPOLLERR | EPOLLHUP)) || !echo(fd))
+				close(fd);
+		}
+	}
+
+	return 0;
+}
+
+// Bind and listen on addr:port, non-blocking
+static int open_listener(struct in_addr * addr, int port)
+{
+	struct sockaddr_in server;
+	int fd, arg = 1;
+
+	if((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+		SystemFatal("socket");
+	if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &arg, sizeof(arg)) == -1)
+		SystemFatal("setsockopt");
+
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_addr = *addr;
+	server.sin_port = htons(port);
+	if(bind(fd, (struct sockaddr *)&server, sizeof(server)) == -1)
+		SystemFatal("bind");
+	if(listen(fd, SOMAXCONN) == -1)
+		SystemFatal("listen");
+	return fd;
+}
+
+// Take every pending connection, the listener is edge-triggered
+static void accept_all(int epoll_fd, int fd)
+{
+	struct epoll_event event;
+	int fd_new;
+
+	while((fd_new = accept4(fd, NULL, NULL, SOCK_NONBLOCK)) != -1){
+		event.events = EPOLLIN | EPOLLET;
+		event.data.u64 = fd_new;
+		if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd_new, &event) == -1)
+			SystemFatal("epoll_ctl");
+	}
+	if(errno != EAGAIN && errno != EWOULDBLOCK)
+		perror("accept");
+}
+
+// Send back everything readable on fd. Returns 0 if it must be closed
+static int echo(int fd)
+{
+	char buf[BUFLEN];
+	int n, k, off;
+
+	while(1){
+		if((n = recv(fd, buf, BUFLEN, 0)) == 0)
+			return 0;
+		if(n == -1)
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+
+		for(off = 0; off < n; off += k){
+			if((k = send(fd, buf + off, n - off, MSG_NOSIGNAL)) == -1)
+				return 0;
+		}
+	}
+}
+
+// Lift the soft descriptor limit to the hard one
+static void raise_nofile(void)
+{
+	struct rlimit nofile;
+
+	if(getrlimit(RLIMIT_NOFILE, &nofile) == -1)
+		SystemFatal("getrlimit");
+	nofile.rlim_cur = nofile.rlim_max;
+	if(setrlimit(RLIMIT_NOFILE, &nofile) == -1)
+		perror("setrlimit");
+}
+
+// Prints the error stored in errno and aborts the program.
+static void SystemFatal(const char* message)
+{
+	perror(message);
+	exit(EXIT_FAILURE);
+}
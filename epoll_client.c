@@ -7,6 +7,18 @@ Usage:		./epoll_client
 			-c <int_connections>
 			-d <string_data>
 			-i <int_iterations>
+			-e <int_events>		Events taken per epoll_wait (default 256)
+			-v			Verify every echoed message
+			
+		The soft RLIMIT_NOFILE is raised to the hard limit, and the hard
+		limit too given CAP_SYS_RESOURCE, to fit one descriptor per connection.
+		
+		With -v each message starts with its CRC32C, the connection index
+		and a sequence number. Echoed messages are gathered per connection,
+		checked, and counted as corrupt (bad checksum or another
+		connection's message), reordered (sequence already seen) or lost
+		(sequence skipped, or never echoed back). The CRC uses the SSE4.2
+		crc32 instruction when the CPU has it, a lookup table otherwise.
 			
 Authors:	Jeremy Tsang
 			Kevin Eng
@@ -23,24 +35,47 @@ Purpose:	COMP 8005 Assignment 2 - Comparing Scalable Servers -
 #include <netdb.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
 
 
 #define BUFLEN 800
-#define EPOLL_QUEUE_LEN 256 // Must be > 0. Only used for backward compatibility.
+#define EPOLL_QUEUE_LEN 256 // Default number of events per epoll_wait
+#define FD_SLACK 64 // Descriptors reserved beyond one per connection
+
+// Header at the start of each message in verify mode
+struct verify_header{
+	uint32_t crc;	// CRC32C of the rest of the message
+	uint32_t conn;	// Index of the sending connection
+	uint32_t seq;	// Sequence number within the connection
+};
+
+struct custom_data;
 
 // Globals
 int print_debug = 0;
+int verify = 0;
 int e_send = 0, e_recv = 0;
+int e_corrupt = 0, e_reorder = 0, e_lost = 0;
+uint32_t crc32c_table[256];
+uint32_t (* crc32c)(const char * buf, int len);
 static void SystemFatal(const char* message);
+static void raise_nofile(int connections);
+static void crc32c_init(void);
+static void verify_stamp(struct custom_data * ptr, char * msg);
+static int verify_recv(struct custom_data * ptr);
 struct timeval start, end;
 
 struct custom_data{
@@ -48,6 +83,11 @@ struct custom_data{
 	int total;		// Total number of messages to send and receive
 	int sent;		// Number of messages sent
 	int received;	// Number of messages received
+	int index;		// Connection index, carried by verified messages
+	int next_seq;	// Next sequence number expected back
+	int corrupt;	// Corrupt messages since the last good one, not lost
+	int rlen;		// Bytes of a message gathered so far in rbuf
+	char * rbuf;	// Message being received, verify mode only
 };
 
 void print_helper(){
@@ -116,10 +156,10 @@ int main (int argc, char ** argv){
 	**********************************************************/
 	
 	char * host, * data;
-	int port, connections, iterations, c;
+	int port, connections, iterations, c, events_size = EPOLL_QUEUE_LEN;
 
 	int num_params = 0;
-	while((c = getopt(argc, argv, "h:p:c:d:i:")) != -1)
+	while((c = getopt(argc, argv, "h:p:c:d:i:e:v")) != -1)
 	{
 		switch(c)
 		{
@@ -139,6 +179,14 @@ int main (int argc, char ** argv){
 			iterations = atoi(
 			optarg);
 			break;
+			case 'e':
+			events_size = atoi(optarg);
+			num_params--;
+			break;
+			case 'v':
+			verify = 1;
+			num_params--;
+			break;
 		}
 		num_params++;
 	}
@@ -151,7 +199,9 @@ Usage: ./epoll_client\n\
 -p <port>\t\tOptionally specify port.\n\
 -c <connections>\tNumber of connections to use.\n\
 -d <data>\t\tData to send.\n\
--i <iterations>\t\tNumber of iterations to use.\n\n");
+-i <iterations>\t\tNumber of iterations to use.\n\
+-e <events>\t\tEvents per epoll_wait (default 256).\n\
+-v\t\t\tVerify every echoed message.\n\n");
 
 		SystemFatal("params");
 	}
@@ -159,13 +209,19 @@ Usage: ./epoll_client\n\
 		if(print_debug == 1)
 			printf("You entered -h %s -p %d -c %d -d %s -i %d\n",host, port, connections, data, iterations);
 	
+	if(events_size < 1)
+		SystemFatal("events");
+	raise_nofile(connections);
+	if(verify)
+		crc32c_init();
+	
 	/**********************************************************
 	Epoll init. Create all sockets and add to epoll event loop
 	**********************************************************/
 	
 	int i, * sd, arg = 1, epoll_fd;
 	sd = malloc(sizeof(int) * connections);
-	static struct epoll_event events[EPOLL_QUEUE_LEN];
+	struct epoll_event * events = malloc(sizeof(struct epoll_event) * events_size);
 	struct epoll_event * event = malloc(sizeof(struct epoll_event) * connections);
 	struct custom_data * cdata = malloc(sizeof(struct custom_data) * connections);
 	
@@ -205,6 +261,13 @@ Usage: ./epoll_client\n\
 		cdata[i].total = iterations;
 		cdata[i].sent = 0;
 		cdata[i].received = 0;
+		cdata[i].index = i;
+		cdata[i].next_seq = 0;
+		cdata[i].corrupt = 0;
+		cdata[i].rlen = 0;
+		cdata[i].rbuf = NULL;
+		if(verify && (cdata[i].rbuf = malloc(BUFLEN)) == NULL)
+			SystemFatal("malloc");
 		
 		// Add all sockets to epoll event loop
 		event[i].events = EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP | EPOLLET;
@@ -229,7 +292,11 @@ Usage: ./epoll_client\n\
 	char rbuf[BUFLEN], sbuf[BUFLEN];
 	
 	bytes_to_read = BUFLEN;
-	strcpy(sbuf, data);
+	memset(sbuf, 0, BUFLEN);
+	if(verify)
+		strncpy(sbuf + sizeof(struct verify_header), data, BUFLEN - sizeof(struct verify_header) - 1);
+	else
+		strcpy(sbuf, data);
 	
 	while(1){
 		
@@ -239,7 +306,7 @@ Usage: ./epoll_client\n\
 		if(fin == connections)
 			break;
 		
-		num_fds = epoll_wait(epoll_fd, events, EPOLL_QUEUE_LEN, timeout);
+		num_fds = epoll_wait(epoll_fd, events, events_size, timeout);
 		if(num_fds < 0)
 			SystemFatal("epoll_wait");
 		else if(num_fds == 0)
@@ -323,8 +390,12 @@ Usage: ./epoll_client\n\
 				while(1){
 				
 					n = 0;
-					// Call recv once for specified amount of data
-					n = recv(ptr->fd, rbuf, bytes_to_read,0);
+					// Call recv once for specified amount of data, or in
+					// verify mode until a whole message was checked
+					if(verify)
+						n = verify_recv(ptr);
+					else
+						n = recv(ptr->fd, rbuf, bytes_to_read,0);
 					
 					// Read fixed size message
 					if(n == BUFLEN){
@@ -370,6 +441,8 @@ Usage: ./epoll_client\n\
 				// Send one message and increase counter	
 				if(ptr->sent == ptr->received && ptr->sent < ptr->total){
 					s = 0;
+					if(verify)
+						verify_stamp(ptr, sbuf);
 					s = send(ptr->fd, sbuf, BUFLEN, 0);
 					
 					// Send fixed size message
@@ -458,9 +531,20 @@ Usage: ./epoll_client\n\
 	if(print_debug == 1)		
 		fprintf(stdout,"fin: %d e_err: %d e_hup: %d e_conn: %d e_in: %d e_out: %d e_recv: %d e_send: %d\n", fin, e_err,e_hup,e_conn,e_in,e_out,e_recv,e_send);
 	
+	// Messages sent but never echoed back are lost too
+	if(verify){
+		for(i = 0; i < connections; i++){
+			if(cdata[i].sent > cdata[i].next_seq + cdata[i].corrupt)
+				e_lost += cdata[i].sent - cdata[i].next_seq - cdata[i].corrupt;
+			free(cdata[i].rbuf);
+		}
+		printf("Verified: %d corrupt, %d reordered, %d lost\n", e_corrupt, e_reorder, e_lost);
+	}
+	
 	free(sd);
 	free(event);
 	free(cdata);
+	free(events);
 	
 	return 0;
 }
@@ -471,3 +555,121 @@ static void SystemFatal(const char* message)
 	exit(EXIT_FAILURE);
 }
 
+// Raise the soft RLIMIT_NOFILE to the hard limit, and the hard limit too if
+// allowed, so that every connection gets a descriptor
+static void raise_nofile(int connections)
+{
+	struct rlimit nofile;
+	rlim_t want = (rlim_t)connections + FD_SLACK;
+
+	if(getrlimit(RLIMIT_NOFILE, &nofile) == -1)
+		SystemFatal("getrlimit");
+	if(nofile.rlim_max != RLIM_INFINITY && nofile.rlim_max < want)
+	{
+		struct rlimit raised = { want, want };
+		if(setrlimit(RLIMIT_NOFILE, &raised) == 0)
+			return;
+	}
+	nofile.rlim_cur = nofile.rlim_max;
+	if(setrlimit(RLIMIT_NOFILE, &nofile) == -1)
+		perror("setrlimit");
+	if(nofile.rlim_cur < want)
+		fprintf(stderr, "RLIMIT_NOFILE is %ld, %d connections may fail with EMFILE\n", (long)nofile.rlim_cur, connections);
+}
+
+// CRC32C (Castagnoli) one byte at a time from a table
+static uint32_t crc32c_sw(const char * buf, int len)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	int i;
+	
+	for(i = 0; i < len; i++)
+		crc = crc32c_table[(crc ^ (unsigned char)buf[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+#if defined(__x86_64__)
+// CRC32C with the SSE4.2 crc32 instruction, eight bytes at a time
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(const char * buf, int len)
+{
+	uint64_t crc = 0xFFFFFFFF, word;
+	
+	for(; len >= 8; buf += 8, len -= 8){
+		memcpy(&word, buf, 8);
+		crc = _mm_crc32_u64(crc, word);
+	}
+	for(; len > 0; buf++, len--)
+		crc = _mm_crc32_u8((uint32_t)crc, (unsigned char)*buf);
+	return ~(uint32_t)crc;
+}
+#endif
+
+// Build the CRC32C table and pick the fastest implementation the CPU has
+static void crc32c_init(void)
+{
+	uint32_t crc;
+	int i, b;
+	
+	for(i = 0; i < 256; i++)
+	{
+		crc = i;
+		for(b = 0; b < 8; b++)
+			crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+		crc32c_table[i] = crc;
+	}
+	
+	crc32c = crc32c_sw;
+#if defined(__x86_64__)
+	if(__builtin_cpu_supports("sse4.2"))
+		crc32c = crc32c_hw;
+#endif
+}
+
+// Write the header of the next message of a connection
+static void verify_stamp(struct custom_data * ptr, char * msg)
+{
+	struct verify_header h;
+	
+	h.conn = ptr->index;
+	h.seq = ptr->sent;
+	memcpy(msg + sizeof(h.crc), &h.conn, sizeof(h) - sizeof(h.crc));
+	h.crc = crc32c(msg + sizeof(h.crc), BUFLEN - sizeof(h.crc));
+	memcpy(msg, &h.crc, sizeof(h.crc));
+}
+
+// Gather one whole message of a connection, which may arrive in pieces, and
+// check it. Returns BUFLEN once a message was checked, otherwise what recv
+// returned with the partial message kept for the next call
+static int verify_recv(struct custom_data * ptr)
+{
+	struct verify_header h;
+	int n;
+	
+	while(ptr->rlen < BUFLEN)
+	{
+		n = recv(ptr->fd, ptr->rbuf + ptr->rlen, BUFLEN - ptr->rlen, 0);
+		if(n <= 0)
+			return n;
+		ptr->rlen += n;
+	}
+	ptr->rlen = 0;
+	
+	memcpy(&h, ptr->rbuf, sizeof(h));
+	if(h.crc != crc32c(ptr->rbuf + sizeof(h.crc), BUFLEN - sizeof(h.crc)) || h.conn != (uint32_t)ptr->index)
+	{
+		e_corrupt++;
+		ptr->corrupt++;
+	}
+	else if(h.seq < (uint32_t)ptr->next_seq)
+		e_reorder++;
+	else
+	{
+		// Skipped sequence numbers not accounted for by corrupt messages
+		if(h.seq - ptr->next_seq > (uint32_t)ptr->corrupt)
+			e_lost += h.seq - ptr->next_seq - ptr->corrupt;
+		ptr->corrupt = 0;
+		ptr->next_seq = h.seq + 1;
+	}
+	return BUFLEN;
+}
@@ -1,7 +1,104 @@
 /*******************************************************************************
 File: 		port_forwarder.c
 
-Usage:				
+Usage:		./port_forwarder
+			-w <int_workers>	Number of event loop worker threads (default 1)
+			-c <cpu_list>		Pin worker i to the i-th CPU of the list, e.g. 0-3,8
+			-k			Splice established TCP pairs in the kernel
+			-s <path>		Hand listeners over to a new process on this Unix socket
+			-u <path>		Take the listeners over from the process serving <path>
+			-f <file>		Read the rules from <file> (default port_forwarder.conf)
+			-m <bytes>[k|m|g]	Memory budget of the relay buffers, see below
+			-n <int_connections>	Concurrent connections to size descriptors and pools for
+			-e <int_events>		Events taken per epoll_wait (default 256)
+
+		With more than one worker every rule gets one SO_REUSEPORT listener
+		per worker. When workers are pinned, each listener is tagged with
+		SO_INCOMING_CPU and a reuseport steering filter hands each new
+		connection to the worker pinned on the CPU that received it. For
+		IRQ-aligned placement, point the IRQ of each NIC RX queue at the
+		CPU of one worker (see /proc/irq/<n>/smp_affinity_list).
+
+		Each line of port_forwarder.conf is
+			<port>[/udp],<server>[|<server>...],<server_port>[,<option>...]
+		Blank lines and anything after a # are ignored. <port> may be a
+		range such as 8000-8099, in which case <server_port> is either a
+		single port or a range of the same size, mapped one to one. Any
+		malformed line stops the forwarder with its line number.
+		The options tune the TCP sockets of that rule:
+			nodelay			TCP_NODELAY on both sides
+			quickack		Re-arm TCP_QUICKACK after every read
+			defer_accept=<s>	TCP_DEFER_ACCEPT on the listener
+			keepalive=<idle>:<intvl>:<cnt>	Keepalive timers in seconds
+			fastopen=<qlen>		TCP_FASTOPEN on the listener
+			fastopen_connect	TCP_FASTOPEN_CONNECT to the server
+			notsent_lowat=<bytes>	TCP_NOTSENT_LOWAT on both sides
+			priority=<0-3>		Order in which reads lose relay buffers under -m (default 0)
+		or, for /udp rules, the UDP flows of that rule:
+			idle=<s>		Expire flows idle for <s> seconds (default 30)
+			gro			Receive with UDP_GRO, resend with UDP_SEGMENT
+
+		A UDP rule keeps one connected socket to the server per client
+		address, so replies find their way back to the right client.
+	
+		TCP connections to the server are non-blocking. The pair waits for
+		EPOLLOUT and checks SO_ERROR, and when the connect fails the next
+		server of the rule is tried, in the order of the config line.
+		TCP_SYNCNT bounds each attempt to a few seconds, so a server that
+		drops SYNs does not hold the pair for the kernel's two minutes.
+		Anything the client sends meanwhile stays queued in its socket
+		until the server is connected. UDP flows use the first server.
+		fastopen_connect only sends the SYN with the first data, so the
+		connect cannot fail over and is refused on rules with several
+		servers.
+	
+		With -k both sockets of an established TCP pair are put in a BPF
+		sockhash whose sk_skb verdict program redirects every segment to
+		the peer socket, so data no longer goes through user space. Pairs
+		fall back to ClearSocket() when BPF is unavailable or the maps are
+		full. Each direction is only redirected once user space forwarded
+		what it had read, see offload_pair() for the window that remains.
+	
+		To upgrade without refusing connections, start the new binary with
+		-u pointing at the -s path of the running one (usually with the same
+		-s path too). The old process passes every listening socket over
+		with SCM_RIGHTS, along with its index in the reuseport group, and
+		worker i adopts the listener at index i so the steering filter
+		still picks the right worker. The old process waits until the new
+		one is ready, then stops accepting and exits once its established
+		pairs and UDP flows have drained.
+
+		When the server side of a pair cannot take more data, the rest of
+		the last read is kept in a BUFLEN relay buffer charged to the
+		pair. That side is not read again until the buffer was flushed on
+		EPOLLOUT, so a pair holds at most two buffers. With -m the relay
+		buffers of all workers share a budget. Above the high watermark,
+		3/4 of the budget, new connections are accepted and closed at
+		once and reads of priority 0 rules take no relay buffer: they peek
+		and only consume what the peer accepts, and when the peer is full
+		that side pauses until EPOLLOUT of the peer. Reads of higher
+		priority rules do so at higher levels up to the budget. A pair
+		whose peer drains keeps moving whatever the other pairs hold.
+	
+		At startup the soft RLIMIT_NOFILE is raised to the hard limit. Once
+		the listeners are open, -n adds two descriptors per connection to
+		those in use and, given CAP_SYS_RESOURCE, raises the hard limit to
+		that. -n also grows the descriptor table and the cinfo pools up
+		front, so the first burst of connections does not pay for it. When accept fails with
+		EMFILE or ENFILE, the worker closes a spare descriptor shared by
+		all workers, accepts and closes the connection, and opens the
+		spare again. If the spare is gone, the listener is re-armed once
+		it could be opened again, so the backlog keeps draining.
+		bench_100k.sh checks 100k concurrent connections, see README.md.
+	
+		SIGUSR1 prints the gauges of every worker: pairs, connects in
+		progress, paused reads, relay buffers, refused connections,
+		connection state and open descriptors.
+		Built with -DPF_STATS, every worker also records the cycles spent
+		in each syscall stage, the syscalls made per event loop iteration,
+		the events returned per epoll_wait and the bytes moved per
+		ClearSocket() call. SIGUSR1 prints them as log2 histograms.
+		Without PF_STATS the instrumentation compiles to nothing.
 	
 Authors:	Jeremy Tsang, Kevin Eng		
 	
@@ -10,21 +107,37 @@ Date:		March 22, 2014
 Purpose:	COMP 8005 Assignment 3 - Basic Application Level Port Forwarder
 
 *******************************************************************************/
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 
@@ -36,38 +149,305 @@ Definitions
 #define FALSE 				0
 #define EPOLL_QUEUE_LEN			256
 #define BUFLEN				1024
+#define MAX_WORKERS			255	// Bounded by the 8 bit jump offsets of the steering filter
+#define POOL_CHUNK			1024	// Number of cinfo allocated each time a pool runs dry
+#define FD_SLACK			64	// Descriptors reserved for UDP flows and upgrades beyond those open and two per connection
+#define CONFIG_FILE			"port_forwarder.conf"
+#define CONFIG_FIELDS			16	// Maximum number of fields on a config line
+#define MAX_SERVERS			16	// Servers of one rule, tried in order
+#define CONNECT_SYNCNT			2	// SYN retries before the next server, about 7s
+#define PORTS				65536	// Size of the port indexed rule lookup
+#define PROTO(type)			((type) == SOCK_DGRAM)	// Index of a socket type in rule_index
+#define SIDE_LISTEN			0	// set_topts() on a listening socket
+#define SIDE_CLIENT			1	// set_topts() on an accepted socket
+#define SIDE_SERVER			2	// set_topts() on a forwarding socket before connect
+#define SIDE_ADOPTED			3	// set_topts() on a listening socket of the previous process
+#define PRIORITIES			4	// Rule priorities, see priority=<n>
+#define PAUSE_POLL			10	// Milliseconds between re-arm attempts of stalled listeners
+#define UDP_BATCH			32	// Datagrams moved per recvmmsg/sendmmsg call
+#define UDP_BUFLEN			65536	// Largest datagram, or GRO train, per message
+#define UDP_IDLE			30	// Default seconds before an idle UDP flow expires
+#define FLOW_BUCKETS			65536	// Buckets of the UDP flow table, power of 2
+#define OFFLOAD_MAX			131072	// Sockets the kernel offload maps can hold
+#define OFFLOAD_FAILED			-1	// cinfo offloaded state, pair stays in user space
+#define OFFLOAD_HASHED			2	// cinfo offloaded state, in the sockhash but read in user space
 
 
-/* cinfo for storing client socket info*/
+#define STAGE_EPOLL			0	// Instrumented stages, see PF_STATS
+#define STAGE_ACCEPT			1
+#define STAGE_SETUP			2	// socket, open, fcntl and epoll_ctl
+#define STAGE_CONNECT			3
+#define STAGE_RECV			4
+#define STAGE_SEND			5
+#define STAGE_CLOSE			6
+#define STAGE_SOCKOPT			7	// setsockopt and getsockopt
+#define STAGE_OFFLOAD			8	// bpf map updates
+#define STAGES				9
+#define STATS_BUCKETS			40	// log2 buckets of a histogram
+
+
+#ifdef PF_STATS
+/* Time a syscall and count it in the current event loop iteration */
+#define STATS_CALL(stage, call)		({ uint64_t t0_ = stats_now(); __typeof__(call) r_ = (call); stats_stage(stage, t0_); r_; })
+#define STATS_WAKEUP(n)			stats_wakeup(n)
+#define STATS_BYTES(n)			stats_bytes(n)
+#else
+#define STATS_CALL(stage, call)		(call)
+#define STATS_WAKEUP(n)
+#define STATS_BYTES(n)
+#endif
+
+
+/* Build one eBPF instruction */
+#define BPF_INSN(c, d, s, o, i)		((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+
+/* topts for storing the socket options of a forwarding rule, 0 means unset */
 typedef struct{
+	int nodelay;		// TCP_NODELAY on both sides
+	int quickack;		// TCP_QUICKACK on both sides, re-armed after each read
+	int defer_accept;	// TCP_DEFER_ACCEPT seconds on the listener
+	int keepalive;		// SO_KEEPALIVE on both sides
+	int keep_idle;		// TCP_KEEPIDLE seconds
+	int keep_intvl;		// TCP_KEEPINTVL seconds
+	int keep_cnt;		// TCP_KEEPCNT probes
+	int fastopen;		// TCP_FASTOPEN queue length on the listener
+	int fastopen_connect;	// TCP_FASTOPEN_CONNECT on the forwarding socket
+	int notsent_lowat;	// TCP_NOTSENT_LOWAT bytes on both sides
+	int priority;		// Reads of higher priorities lose relay buffers last under -m
+	int udp_idle;		// Seconds before an idle UDP flow expires
+	int udp_gro;		// UDP_GRO on receive, UDP_SEGMENT on send
+}topts;
+
+
+struct finfo;
+struct sinfo;
+struct rinfo;
+
+
+/* cinfo for storing client socket info*/
+typedef struct cinfo{
 	int fd;		// Socket descriptor
 	int fd_pair;	// Corresponding socket to forward to
 	int active;	// Set to true when socket is confirmed to be connected
+	int connecting;	// Upstream connect in progress, waiting for EPOLLOUT
+	int server;	// Server of the rule the upstream socket connects to
+	struct rinfo * rule;	// Rule of the pair, to try its next server
+	const topts * opts;	// TCP options of the rule the pair belongs to
+	struct finfo * flow;	// UDP flow of an upstream socket, NULL for TCP pairs
+	struct sinfo * server_info;	// Listener info, NULL for connected sockets
+	int offloaded;	// TRUE once its reads are redirected in the kernel, see OFFLOAD_HASHED
+	uint64_t cookie;	// Socket cookie, key of the offload maps
+	struct cinfo * pair;	// cinfo of fd_pair
+	char * buf;		// Relay buffer, data read on fd not yet sent on fd_pair
+	int buf_off;		// Offset and length of the data left in buf
+	int buf_len;
+	int out_armed;		// EPOLLOUT was added to the events of fd
+	int paused;		// Reads wait for EPOLLOUT of the pair, without relay buffer
+	struct cinfo * next;	// Next entry on the pool free list
 }cinfo;
 
 
+/* rinfo for storing a forwarding rule, all rules live in one dense array */
+typedef struct rinfo{
+	struct sockaddr_in server_addr;	// Resolved first server address and port
+	topts * opts;		// Options, shared by all rules of a config line
+	struct in_addr * servers;	// Servers of the config line, tried in order
+	uint16_t port;		// Local port
+	uint16_t type;		// SOCK_STREAM or SOCK_DGRAM
+	uint16_t servers_size;
+	int line;		// Line of the config file the rule comes from
+}rinfo;
+
+
 /* sinfo for storing server socket info */
-typedef struct{
+typedef struct sinfo{
 	int fd;		// Socket descriptor
-	char * server;	// Server to forward to
-	int server_port;// Server port
+	rinfo * rule;	// Rule the socket listens for
+	struct finfo * idle_head;	// UDP flows of this listener, least recently used first
+	struct finfo * idle_tail;
+	cinfo * listen_info;	// epoll data of the listener
+	int stalled;	// Set when a pending connection could not be refused
+	int index;	// Position in the reuseport group of the rule
 }sinfo;
 
 
+/* finfo for storing a UDP flow, one per client address of a UDP rule */
+typedef struct finfo{
+	struct sockaddr_in client;	// Client address, key of the flow
+	sinfo * server_info;		// Listener the flow was received on
+	cinfo * c_ptr;			// cinfo of the connected upstream socket
+	time_t last;			// Time of the last datagram in either direction
+	struct finfo * hnext;		// Next flow in the same hash bucket
+	struct finfo * prev;		// Idle list of the listener
+	struct finfo * next;
+}finfo;
+
+
+/* ubatch for storing the recvmmsg/sendmmsg vectors of a worker */
+typedef struct{
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iovs[UDP_BATCH];
+	struct sockaddr_in addrs[UDP_BATCH];
+	char cmsgs[UDP_BATCH][CMSG_SPACE(sizeof(int))];
+	finfo * flows[UDP_BATCH];
+	char * bufs;	// UDP_BATCH buffers of UDP_BUFLEN bytes
+}ubatch;
+
+
+/* pstats for storing the instrumentation counters of a worker */
+typedef struct{
+	uint64_t calls[STAGES];			// Syscalls made in each stage
+	uint64_t cycles[STAGES];		// Cycles spent in each stage
+	uint64_t stage_hist[STAGES][STATS_BUCKETS];	// Cycles per call
+	uint64_t wakeups;			// epoll_wait returns
+	uint64_t full;				// Wakeups that filled the event array
+	uint64_t events_hist[STATS_BUCKETS];	// Events per wakeup
+	uint64_t syscalls_hist[STATS_BUCKETS];	// Syscalls per iteration
+	uint64_t bytes_hist[STATS_BUCKETS];	// Bytes per ClearSocket call
+	uint64_t iteration;			// Syscalls made so far in this iteration
+}pstats;
+
+
+/* linfo for storing a listening socket handed over between processes */
+typedef struct{
+	int fd;		// Socket descriptor, -1 once adopted
+	int port;	// Local port
+	int type;	// SOCK_STREAM or SOCK_DGRAM
+	int index;	// Position in the reuseport group of its port
+}linfo;
+
+
+/* winfo for storing event loop worker info */
+typedef struct{
+	int id;			// Worker index, also its position in each reuseport group
+	int cpu;		// CPU the worker is pinned to, -1 if not pinned
+	int epoll_fd;		// Epoll descriptor of the worker
+	pthread_t thread;	// Thread running the event loop
+	sinfo ** servers;	// Array of server sockets owned by this worker
+	int servers_size;
+	cinfo * pool_free;	// Free cinfo, allocated by the worker itself
+	cinfo * pool_dead;	// cinfo released during the current epoll batch
+	int udp;		// Set when the worker owns UDP listeners
+	finfo ** flows;		// UDP flow table, FLOW_BUCKETS entries
+	ubatch * batch;		// UDP message vectors
+	time_t now;		// Monotonic seconds at the last wakeup
+	int conns;		// Open TCP pairs and UDP flows
+	int draining;		// Set once the listeners were handed over
+	int stopped;		// Set once the worker stopped accepting
+	int paused_size;	// Gauges, written by the worker only
+	int connecting;
+	int buffered;
+	long relay;		// Bytes of relay buffers held by the worker
+	long refused;		// Connections refused for lack of memory, descriptors or servers
+	long pool_size;		// cinfo allocated by the worker
+	int stalled;		// Set while listeners wait to be re-armed, see sinfo
+#ifdef PF_STATS
+	pstats stats;		// Instrumentation counters
+#endif
+}winfo;
+
+
 
 /*******************************************************************************
 Globals and Prototypes
 *******************************************************************************/
 /* Globals */
-sinfo ** servers = NULL;	// Array of server sockets listening
-int servers_size = 0;
+winfo * workers = NULL;		// Array of event loop workers
+int workers_size = 1;
+int * cpus = NULL;		// CPUs to pin workers to
+int cpus_size = 0;
+int offload = FALSE;		// Set when the kernel offload maps and programs are loaded
+int offload_socks = -1;		// BPF sockhash of the offloaded sockets, keyed by cookie
+int offload_peers = -1;		// BPF hash from a socket cookie to the cookie of its pair
+char * control_path = NULL;	// Unix socket path to hand listeners over on
+int control_fd = -1;		// Listening Unix socket on control_path
+int upgrade_fd = -1;		// Connection to the previous process during an upgrade
+int drain_fd = -1;		// eventfd telling the workers to stop accepting
+linfo * inherited = NULL;	// Listeners received from the previous process
+int inherited_size = 0;
+rinfo * rules = NULL;		// Rule table
+int rules_size = 0;
+int rules_max = 0;
+uint32_t * rule_index[2];	// Rule number + 1 by local port, TCP then UDP
+long relay_budget = 0;		// Bytes of relay buffers allowed, 0 for no limit
+long relay_used = 0;		// Bytes of relay buffers of all workers, atomic
+long relay_limits[PRIORITIES];	// Relay bytes above which reads of a priority take no buffer
+int epoll_events = EPOLL_QUEUE_LEN;	// Events taken per epoll_wait
+int spare_fd = -1;		// Given up to refuse a connection on EMFILE or ENFILE
+pthread_mutex_t spare_lock = PTHREAD_MUTEX_INITIALIZER;	// Workers share the descriptor table
+long target_conns = 0;		// Expected concurrent connections, 0 if not given
+#ifdef PF_STATS
+static __thread pstats * stats_local;	// Counters of the worker running on this thread
+#endif
 
 
 /* Function prototypes */
 static void SystemFatal (const char* message);
-static int ClearSocket (cinfo * c_ptr);
+static int ClearSocket (winfo * w, cinfo * c_ptr);
 void close_server (int);
-sinfo * is_server(int fd);
+void * worker_loop(void * arg);
+static int parse_cpus(const char * list, int ** out);
+static void steer_listener(int fd);
+static cinfo * cinfo_get(winfo * w);
+static void pool_grow(winfo * w);
+static void raise_nofile(void);
+static void size_nofile(void);
+static int open_fds(void);
+static void cinfo_put(winfo * w, cinfo * c_ptr);
+static void close_pair(winfo * w, cinfo * c_ptr);
+static void close_relay(winfo * w, cinfo * c_ptr);
+static int connect_server(winfo * w, cinfo * c_ptr, int server);
+static void connect_done(winfo * w, cinfo * c_ptr);
+static int relay_full(int priority);
+static void relay_stash(winfo * w, cinfo * c_ptr, const char * data, int len);
+static int relay_flush(winfo * w, cinfo * c_ptr);
+static void relay_release(winfo * w, cinfo * c_ptr);
+static void relay_pause(winfo * w, cinfo * c_ptr);
+static int relay_resume(winfo * w, cinfo * c_ptr);
+static void relay_arm(winfo * w, cinfo * c_ptr);
+static long parse_size(const char * size);
+static int parse_topt(const char * option, topts * o);
+static int parse_number(const char ** s, long min, long max, int * out);
+static void set_topts(int fd, const topts * o, int side);
+static void udp_from_client(winfo * w, sinfo * s_ptr);
+static void udp_from_server(winfo * w, finfo * f);
+static finfo * flow_get(winfo * w, sinfo * s_ptr, struct sockaddr_in * client);
+static void flow_touch(winfo * w, finfo * f);
+static void flow_remove(winfo * w, finfo * f);
+static unsigned int flow_bucket(sinfo * s_ptr, struct sockaddr_in * client);
+static void flow_expire(winfo * w);
+static void batch_reset(ubatch * b, int gro);
+static void batch_segment(struct msghdr * h);
+static int offload_init(void);
+static int offload_pair(winfo * w, cinfo * c_ptr);
+static void offload_release(cinfo * c_ptr);
+static void add_server(winfo * w, sinfo * s_ptr);
+static void remove_server(winfo * w);
+static int adopt_listener(int port, int type, int index);
+static void load_rules(const char * path);
+static int parse_ports(char * field, int * first, int * last, int * type);
+static int resolve_servers(const char * field, struct in_addr ** servers);
+static void config_error(const char * path, int line, const char * format, ...);
+static int open_listener(rinfo * r, winfo * w);
+static int listener_error(rinfo * r, winfo * w, int fd, const char * step);
+static void listener_opts(rinfo * r, int fd, int adopted);
+static int compare_linfo(const void * a, const void * b);
+void * report_loop(void * arg);
+#ifdef PF_STATS
+static inline uint64_t stats_now(void);
+static inline void stats_stage(int stage, uint64_t start);
+static void stats_wakeup(int num_fds);
+static void stats_bytes(int bytes);
+static void stats_dump(winfo * w);
+#endif
+static void upgrade_receive(const char * path);
+void * upgrade_loop(void * arg);
+static int upgrade_send(int fd);
+static void stop_servers(winfo * w);
+static int spare_refuse(int fd);
+static int spare_reopen(void);
+static void listener_rearm(winfo * w);
 
 
 
@@ -76,10 +456,90 @@ Main
 *******************************************************************************/
 int main (int argc, char* argv[]) {
 
-	int i, arg; 
-	int num_fds, epoll_fd;
-	static struct epoll_event events[EPOLL_QUEUE_LEN], event;
+	int i, c, r;
+	static struct epoll_event event;
 	struct sigaction act;
+
+	// Parse input parameters
+	char * upgrade_path = NULL, * config_path = CONFIG_FILE;
+	while((c = getopt(argc, argv, "w:c:ks:u:f:m:n:e:")) != -1){
+		switch(c){
+			case 'w':
+			workers_size = atoi(optarg);
+			break;
+			case 'c':
+			if((cpus_size = parse_cpus(optarg, &cpus)) <= 0){
+				fprintf(stderr, "Invalid CPU list: %s\n", optarg);
+				exit (EXIT_FAILURE);
+			}
+			break;
+			case 'k':
+			offload = TRUE;
+			break;
+			case 's':
+			control_path = optarg;
+			break;
+			case 'u':
+			upgrade_path = optarg;
+			break;
+			case 'f':
+			config_path = optarg;
+			break;
+			case 'm':
+			if((relay_budget = parse_size(optarg)) <= 0){
+				fprintf(stderr, "Invalid memory budget: %s\n", optarg);
+				exit (EXIT_FAILURE);
+			}
+			break;
+			case 'n':
+			target_conns = atol(optarg);
+			break;
+			case 'e':
+			epoll_events = atoi(optarg);
+			break;
+			default:
+			fprintf(stderr, "Usage: %s [-w workers] [-c cpu_list] [-k] [-s path] [-u path] [-f file] [-m bytes] [-n connections] [-e events]\n", argv[0]);
+			exit (EXIT_FAILURE);
+		}
+	}
+
+	if(workers_size < 1 || workers_size > MAX_WORKERS){
+		fprintf(stderr, "Number of workers must be between 1 and %d\n", MAX_WORKERS);
+		exit (EXIT_FAILURE);
+	}
+	if(epoll_events < 1 || target_conns < 0){
+		fprintf(stderr, "Events per epoll_wait must be at least 1 and connections not negative\n");
+		exit (EXIT_FAILURE);
+	}
+	raise_nofile();
+	
+	// Only the report thread takes SIGUSR1. Block it before any thread is
+	// started, they all inherit the mask
+	sigset_t usr1;
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+	
+	// Every worker may fill one more buffer between two checks, keep room
+	// for them under the budget
+	if(relay_budget){
+		long top = relay_budget - (long)workers_size * BUFLEN, high = top / 4 * 3;
+		if(top < (long)workers_size * BUFLEN * PRIORITIES){
+			fprintf(stderr, "Memory budget must be at least %ld bytes\n", (long)workers_size * BUFLEN * (PRIORITIES + 1));
+			exit (EXIT_FAILURE);
+		}
+		for(i = 0; i < PRIORITIES; i++)
+			relay_limits[i] = high + (top - high) * i / PRIORITIES;
+	}
+	
+	if(offload && !offload_init()){
+		perror("Kernel offload unavailable, forwarding in user space");
+		offload = FALSE;
+		if(offload_socks != -1)
+			close(offload_socks);
+		if(offload_peers != -1)
+			close(offload_peers);
+	}
 	
 	// set up the signal handler to close the server socket when CTRL-c is received
    	act.sa_handler = close_server;
@@ -89,117 +549,229 @@ int main (int argc, char* argv[]) {
 		exit (EXIT_FAILURE);
 	}
 	
-	// Create the epoll file descriptor
-	epoll_fd = epoll_create(EPOLL_QUEUE_LEN);
-	if (epoll_fd == -1) 
-		SystemFatal("epoll_create");
+	// Take the listeners of the running process before binding anything
+	if(upgrade_path != NULL)
+		upgrade_receive(upgrade_path);
 	
-	// Read config file and create all listening sockets and add to epoll
-	FILE * fp;
-	ssize_t read;
-	size_t len = 0;
-	char * line = NULL;
+	// Create one epoll file descriptor per worker
+	workers = calloc(workers_size, sizeof(winfo));
+	for(i = 0; i < workers_size; i++){
+		workers[i].id = i;
+		workers[i].cpu = (cpus_size > 0) ? cpus[i % cpus_size] : -1;
+		workers[i].epoll_fd = epoll_create1(0);
+		if (workers[i].epoll_fd == -1)
+			SystemFatal("epoll_create");
+	}
+	spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 	
-	fp = fopen("port_forwarder.conf","r");
-	while((read = getline(&line, &len, fp)) != -1){
-		
-		// Tokenize each line into array
-		char * token;
-		char * config[3];
-		int config_index = 0;
-		
-		token = strtok(line,",");
-		while(token != NULL){
-			config[config_index++] = token;
-			token = strtok(NULL,",");
-		}
-		//printf("Tokenized into %d\n",config_index);
-		
-		// Info from each line
-		int port = atoi(config[0]);
-		char * server = malloc(sizeof(config[1]));
-		strcpy(server,config[1]);
-		int server_port = atoi(config[2]);
-		
-		// Create the listening socket
-		int fd_server;
-
-		fd_server = socket (AF_INET, SOCK_STREAM, 0);
-		if (fd_server == -1) 
-			SystemFatal("socket");
+	// Read config file into the rule table
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	load_rules(config_path);
 	
-		// set SO_REUSEADDR so port can be reused immediately after exit, i.e., after CTRL-c
-		arg = 1;
-		if (setsockopt (fd_server, SOL_SOCKET, SO_REUSEADDR, &arg, sizeof(arg)) == -1) 
-			SystemFatal("setsockopt");
+	// Create one listening socket per rule and worker and add to epoll.
+	// Workers join each reuseport group in order, so worker i is at index i.
+	// Adopted listeners keep the index they had in the previous process,
+	// so worker i takes the one that was at index i there
+	int listeners = 0, failed = 0;
+	for(r = 0; r < rules_size; r++){
+		for(i = 0; i < workers_size; i++){
+			int fd_server = open_listener(&rules[r], &workers[i]);
+			if(fd_server == -1){
+				// Leave no worker accepting for a rule reported as not bound
+				while(i-- > 0){
+					remove_server(&workers[i]);
+					listeners--;
+				}
+				failed++;
+				break;
+			}
 	
-		// Make the server listening socket non-blocking
-		if (fcntl (fd_server, F_SETFL, O_NONBLOCK | fcntl (fd_server, F_GETFL, 0)) == -1) 
+			// Add to server list of the worker
+			sinfo * server_sinfo = calloc(1, sizeof(sinfo));
+			server_sinfo->fd = fd_server;
+			server_sinfo->rule = &rules[r];
+			server_sinfo->index = i;
+			add_server(&workers[i], server_sinfo);
+			listeners++;
+		}
+
+		// Whole group is bound, install the CPU steering program on it
+		if (i == workers_size && workers_size > 1 && cpus_size > 0)
+			steer_listener(workers[0].servers[workers[0].servers_size-1]->fd);
+	}
+    
+	// Listeners the previous process had more of than we have workers
+	// still get connections, so worker 0 serves them. Listeners of rules
+	// that are gone are closed
+	for(i = 0; i < inherited_size; i++){
+		if(inherited[i].fd == -1)
+			continue;
+		if((r = rule_index[PROTO(inherited[i].type)][inherited[i].port]) == 0){
+			printf("Closing inherited fd (%d) on port %d, no rule for it\n", inherited[i].fd, inherited[i].port);
+			close(inherited[i].fd);
+			continue;
+		}
+		sinfo * server_sinfo = calloc(1, sizeof(sinfo));
+		server_sinfo->fd = inherited[i].fd;
+		server_sinfo->rule = &rules[r - 1];
+		server_sinfo->index = inherited[i].index;
+		listener_opts(server_sinfo->rule, server_sinfo->fd, TRUE);
+		if (fcntl (server_sinfo->fd, F_SETFL, O_NONBLOCK | fcntl (server_sinfo->fd, F_GETFL, 0)) == -1)
 			SystemFatal("fcntl");
+		add_server(&workers[0], server_sinfo);
+		listeners++;
+	}
 	
-		// Bind to the specified listening port
-		struct sockaddr_in addr;
-		memset (&addr, 0, sizeof (struct sockaddr_in));
-		addr.sin_family = AF_INET;
-		addr.sin_addr.s_addr = htonl(INADDR_ANY);
-		addr.sin_port = htons(port);
-		
-		printf("Listening on port %d (forwards to %s:%d) using fd (%d)...\n",port,server,server_port,fd_server);
-		
-		if (bind (fd_server, (struct sockaddr*) &addr, sizeof(addr)) == -1) 
-			SystemFatal("bind");
-	
-		// Listen for fd_news; SOMAXCONN is 128 by default
-		if (listen (fd_server, SOMAXCONN) == -1) 
-			SystemFatal("listen");
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("%d rules, %d listeners, %d rules not bound, ready in %.1f ms, rule table %lu bytes\n",
+		rules_size, listeners, failed,
+		(t1.tv_sec - t0.tv_sec) * 1000.0 + (t1.tv_nsec - t0.tv_nsec) / 1000000.0,
+		(unsigned long)(sizeof(rinfo) * rules_max + 2 * sizeof(uint32_t) * PORTS));
 	
-		// Add to server list
-		sinfo * server_sinfo = malloc(sizeof(sinfo));
-		server_sinfo->fd = fd_server;
-		server_sinfo->server = server;
-		server_sinfo->server_port = server_port;
+	// Serve the next upgrade, then tell the previous process we are ready
+	if(control_path != NULL){
+		struct sockaddr_un un;
+		memset(&un, 0, sizeof(un));
+		un.sun_family = AF_UNIX;
+		strncpy(un.sun_path, control_path, sizeof(un.sun_path) - 1);
+		unlink(control_path);
+		if((control_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+			SystemFatal("socket");
+		if(bind(control_fd, (struct sockaddr *)&un, sizeof(un)) == -1 || listen(control_fd, 1) == -1)
+			SystemFatal("control socket");
+		if((drain_fd = eventfd(0, EFD_NONBLOCK)) == -1)
+			SystemFatal("eventfd");
 		
-		servers = realloc(servers,sizeof(sinfo *) * ++servers_size);
-		servers[servers_size-1] = server_sinfo;
-	
-		// Add the server socket to the epoll event loop with it's data
-		event.events = EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLET;
+		// Level triggered, each worker removes it once it has stopped
+		for(i = 0; i < workers_size; i++){
+			cinfo * drain_cinfo = calloc(1, sizeof(cinfo));
+			drain_cinfo->fd = drain_fd;
+			event.events = EPOLLIN;
+			event.data.ptr = (void *)drain_cinfo;
+			if (epoll_ctl (workers[i].epoll_fd, EPOLL_CTL_ADD, drain_fd, &event) == -1)
+				SystemFatal("epoll_ctl");
+		}
 		
-		cinfo * server_cinfo = malloc(sizeof(cinfo));
-		server_cinfo->fd = fd_server;
-		event.data.ptr = (void *)server_cinfo;
-	
-		if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, fd_server, &event) == -1)
-			SystemFatal("epoll_ctl");
+		pthread_t t;
+		if((errno = pthread_create(&t, NULL, &upgrade_loop, NULL)) != 0)
+			SystemFatal("pthread_create");
+	}
+	if(upgrade_fd != -1){
+		if(send(upgrade_fd, "R", 1, MSG_NOSIGNAL) != 1)
+			perror("upgrade ready");
+		close(upgrade_fd);
 	}
 	
-	if(line)
-		free(line);
-	
-	fclose(fp);
+	// Everything but the connections is open now
+	size_nofile();
     
+	pthread_t report_thread;
+	if((errno = pthread_create(&report_thread, NULL, &report_loop, NULL)) != 0)
+		SystemFatal("pthread_create");
+	
+	// Start the workers and wait for them, they only return on error or
+	// once drained after an upgrade
+	for(i = 0; i < workers_size; i++){
+		if((errno = pthread_create(&workers[i].thread, NULL, &worker_loop, &workers[i])) != 0)
+			SystemFatal("pthread_create");
+	}
+	for(i = 0; i < workers_size; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	exit (EXIT_SUCCESS);
+}
+
+
+
+/*******************************************************************************
+Worker event loop. Pins itself first so that the connection state it allocates
+is touched, and therefore placed, on its own NUMA node.
+*******************************************************************************/
+void * worker_loop(void * arg) {
+
+	winfo * w = (winfo *)arg;
+	int i, num_fds;
+	struct epoll_event * events, event;
+
+	if (w->cpu != -1){
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		if ((errno = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0)
+			perror("pthread_setaffinity_np");
+		else
+			printf("Worker %d pinned to CPU %d\n", w->id, w->cpu);
+	}
+
+#ifdef PF_STATS
+	stats_local = &w->stats;
+#endif
+	
+	// Warm up the pool now that we run on our own node, two cinfo for each
+	// connection the worker is expected to take
+	do
+		pool_grow(w);
+	while (w->pool_size < 2 * target_conns / workers_size);
+	if ((events = malloc(sizeof(struct epoll_event) * epoll_events)) == NULL)
+		SystemFatal("malloc");
+	if (w->udp){
+		w->flows = calloc(FLOW_BUCKETS, sizeof(finfo *));
+		w->batch = calloc(1, sizeof(ubatch));
+		if (w->flows == NULL || w->batch == NULL || (w->batch->bufs = malloc(UDP_BATCH * UDP_BUFLEN)) == NULL)
+			SystemFatal("malloc");
+	}
+
 	// Execute the epoll event loop
 	while (TRUE){
 	
 		//fprintf(stdout,"epoll wait\n");
 		
-		num_fds = epoll_wait (epoll_fd, events, EPOLL_QUEUE_LEN, -1);
-		if (num_fds < 0)
+		// Wake up every second to expire idle UDP flows, and more often to
+		// get descriptors for stalled listeners
+		num_fds = STATS_CALL(STAGE_EPOLL, epoll_wait (w->epoll_fd, events, epoll_events,
+			w->stalled ? PAUSE_POLL : w->udp ? 1000 : -1));
+		if (num_fds < 0){
+			if (errno == EINTR)
+				continue;
 			SystemFatal ("epoll_wait");
+		}
+		STATS_WAKEUP(num_fds);
+		
+		if (w->udp){
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			w->now = ts.tv_sec;
+		}
 
 		for (i = 0; i < num_fds; i++){
+
+			// Get socket cinfo
+			cinfo * c_ptr = (cinfo *)events[i].data.ptr;
+
+			// Pair was closed earlier in this batch
+			if (c_ptr->fd == -1)
+				continue;
+			
+			// Listeners were handed over, stop once this batch is done
+			if (c_ptr->fd == drain_fd){
+				w->draining = TRUE;
+				continue;
+			}
+			
+			// Connect to the server finished, or failed
+			if (c_ptr->connecting){
+				connect_done(w, c_ptr);
+				continue;
+			}
 			
 	    		// EPOLLHUP
 	    		if (events[i].events & EPOLLHUP){
 	    		
-	    			// Get socket cinfo
-	    			cinfo * c_ptr = (cinfo *)events[i].data.ptr;
-    		
     				if(c_ptr->active == 1){
 					fprintf(stdout,"EPOLLHUP - closing fd: %d\n", c_ptr->fd);
 				
-					close(c_ptr->fd);
-					//free(c_ptr);
+					close_pair(w, c_ptr);
 				}
 				continue;
 			}
@@ -207,128 +779,167 @@ int main (int argc, char* argv[]) {
 			// EPOLLERR
 			if (events[i].events & EPOLLERR){
 			
-				// Get socket cinfo
-    				cinfo * c_ptr = (cinfo *)events[i].data.ptr;
-			
 				fprintf(stdout,"EPOLLERR - closing fd: %d\n", c_ptr->fd);
 				
-				close(c_ptr->fd);
+				close_pair(w, c_ptr);
 				
 				continue;
 			}
 			
+			// The socket can take data again, flush what its pair kept for
+			// it or read its pair again
+			if (events[i].events & EPOLLOUT){
+				cinfo * p_ptr = c_ptr->pair;
+				int ok = TRUE;
+				if (p_ptr->buf != NULL)
+					ok = relay_flush(w, p_ptr);
+				else if (p_ptr->paused)
+					ok = relay_resume(w, p_ptr);
+				if (!ok){
+					close_pair(w, c_ptr);
+					continue;
+				}
+				if (!(events[i].events & EPOLLIN))
+					continue;
+			}
+			
 	    		assert (events[i].events & EPOLLIN);
 	    						
 	    		// EPOLLIN
 	    		if (events[i].events & EPOLLIN){
     				
-				// Get socket cinfo
-				cinfo * c_ptr = (cinfo *)events[i].data.ptr;
-	    			
+				// Datagrams from clients of a UDP rule
+				sinfo * s_ptr = c_ptr->server_info;
+				if (s_ptr != NULL && s_ptr->rule->type == SOCK_DGRAM){
+					udp_from_client(w, s_ptr);
+				}
 				// Server is receiving one or more incoming connection requests
-				sinfo * s_ptr = NULL;
-				if ((s_ptr = is_server(c_ptr->fd)) != NULL){
+				else if (s_ptr != NULL){
 					
 					while(1){
 						
 						// Accept connection
 						struct sockaddr_in in_addr;
-						socklen_t in_len;
+						socklen_t in_len = sizeof(in_addr);
 						int fd_new = 0;
 						//memset (&in_addr, 1, sizeof (struct sockaddr_in));
-						fd_new = accept(s_ptr->fd, (struct sockaddr *)&in_addr, &in_len);
+						fd_new = STATS_CALL(STAGE_ACCEPT, accept(s_ptr->fd, (struct sockaddr *)&in_addr, &in_len));
 						if (fd_new == -1){
+							// Out of descriptors, the connection would stay
+							// in the backlog with no new edge to report it.
+							// Refuse it on the spare descriptor instead, or
+							// re-arm the listener once there is a spare again
+							if (errno == EMFILE || errno == ENFILE){
+								if (spare_refuse(s_ptr->fd)){
+									w->refused++;
+									continue;
+								}
+								s_ptr->stalled = TRUE;
+								w->stalled = TRUE;
+							}
 							// If error in accept call
-							if (errno != EAGAIN && errno != EWOULDBLOCK)
+							else if (errno != EAGAIN && errno != EWOULDBLOCK)
 								perror("accept");
 								
 							// All connections have been processed
 							break;
 						}
 						
-						printf("EPOLLIN - connected fd: %d\n", fd_new);
+						// Over the high watermark, refuse rather than take more state
+						if (relay_full(0)){
+							STATS_CALL(STAGE_CLOSE, close(fd_new));
+							w->refused++;
+							continue;
+						}
+						
+						printf("EPOLLIN - connected fd: %d on worker %d\n", fd_new, w->id);
 						
 						// Make fd_new non blocking
-						if (fcntl (fd_new, F_SETFL, O_NONBLOCK | fcntl(fd_new, F_GETFL, 0)) == -1) 
+						int flags = STATS_CALL(STAGE_SETUP, fcntl(fd_new, F_GETFL, 0));
+						if (STATS_CALL(STAGE_SETUP, fcntl (fd_new, F_SETFL, O_NONBLOCK | flags)) == -1) 
 							SystemFatal("fcntl");
 						
-						// Create corresponding socket to forward to
-						int fd_pair;
-						if((fd_pair = socket(AF_INET, SOCK_STREAM, 0)) == -1)
-							SystemFatal("socket");
+						cinfo * client_info = cinfo_get(w);
+						cinfo * client_info2 = cinfo_get(w);
 						
+						// Start the connect to the server, the client
+						// is refused if no server can be tried
+						client_info->fd = fd_new;
+						client_info->pair = client_info2;
+						client_info2->fd = -1;
+						client_info2->fd_pair = fd_new;
+						client_info2->pair = client_info;
+						client_info2->rule = s_ptr->rule;
+						client_info2->opts = s_ptr->rule->opts;
+						if (!connect_server(w, client_info2, 0)){
+							STATS_CALL(STAGE_CLOSE, close(fd_new));
+							w->refused++;
+							cinfo_put(w, client_info2);
+							cinfo_put(w, client_info);
+							continue;
+						}
+						w->conns++;
+
 						// Add fd_new to epoll
 						event.events = EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLET;
 						
-						cinfo * client_info = malloc(sizeof(cinfo));
-						client_info->fd = fd_new;
-						client_info->fd_pair = fd_pair;
+						client_info->active = 1;
+						client_info->opts = s_ptr->rule->opts;
+						set_topts(fd_new, s_ptr->rule->opts, SIDE_CLIENT);
 						event.data.ptr = (void *)client_info;
 						
-						if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, fd_new, &event) == -1) 
+						if (STATS_CALL(STAGE_SETUP, epoll_ctl (w->epoll_fd, EPOLL_CTL_ADD, fd_new, &event)) == -1)
 							SystemFatal ("epoll_ctl");
 						
-						// Initialize fd_pair sockaddr_in
-						struct sockaddr_in server;
-						struct hostent * hp;
-						memset(&server, 0, sizeof(struct sockaddr_in));
-						server.sin_family = AF_INET;
-						server.sin_port = htons(s_ptr->server_port);
-						printf("gethostbyname (%s)\n",s_ptr->server);
-						if((hp = gethostbyname(s_ptr->server)) == NULL)
-							SystemFatal("gethostbyname");
-						bcopy(hp->h_addr, (char *)&server.sin_addr, hp->h_length);
-						
-						// Set SO_REUSEADDR so port can be reused immediately
-						int arg = 1;
-						if(setsockopt(fd_pair, SOL_SOCKET, SO_REUSEADDR, &arg, sizeof(arg)) == -1)
-							SystemFatal("setsockopt");
-		
-						// Make server socket non-blocking
-						if(fcntl(fd_pair, F_SETFL, O_NONBLOCK | fcntl(fd_pair, F_GETFL, 0)) == -1)
-							SystemFatal("fcntl");
-						
-						// Connect fd_pair
-						if(connect(fd_pair, (struct sockaddr *)&server, sizeof(server)) == -1){
-							if(errno == EINPROGRESS) // Only connecting on non-blocking socket
-								;
-							else
-								SystemFatal("connect");
-						}
-						
-						// Add fd_pair to epoll
-						event.events = EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLET;
-						
-						cinfo * client_info2 = malloc(sizeof(cinfo));
-						client_info2->fd = fd_pair;
-						client_info2->fd_pair = fd_new;
-						client_info2->active = 0;
-						event.data.ptr = (void *)client_info2;
-		
-						if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd_pair, &event) == -1)
-							SystemFatal("epoll_ctl");
-						
 						continue;
 					}
 				}
+				// Replies to a UDP flow
+				else if (c_ptr->flow != NULL){
+					udp_from_server(w, c_ptr->flow);
+				}
+				// Server is not connected yet, the data waits in the client socket
+				else if (c_ptr->pair->connecting){
+					continue;
+				}
 				// Else one of the sockets has read data
 				else{
 					fprintf(stdout,"EPOLLIN - read fd: %d\n", c_ptr->fd);
 					
-					if (!ClearSocket(c_ptr)){
+					if (!ClearSocket(w, c_ptr)){
 						// epoll will remove the fd from its set
 						// automatically when the fd is closed
-						close(c_ptr->fd);
-						
-						// Close forwarding socket
-						close(c_ptr->fd_pair);
+						close_pair(w, c_ptr);
 					}
+					// Splice the pair once user space holds nothing of it
+					else if (offload && (c_ptr->offloaded == FALSE || c_ptr->offloaded == OFFLOAD_HASHED)
+						&& !offload_pair(w, c_ptr))
+						close_pair(w, c_ptr);
 				}
 			}
 		}
+
+		if (w->udp)
+			flow_expire(w);
+		if (w->stalled && !w->stopped && spare_reopen())
+			listener_rearm(w);
+
+		// Nothing in the batch refers to the closed pairs anymore
+		while (w->pool_dead != NULL){
+			cinfo * c_ptr = w->pool_dead;
+			w->pool_dead = c_ptr->next;
+			cinfo_put(w, c_ptr);
+		}
+		
+		if (w->draining && !w->stopped)
+			stop_servers(w);
+		if (w->draining && w->conns == 0){
+			printf("Worker %d drained\n", w->id);
+			break;
+		}
 	}
 	
-	exit (EXIT_SUCCESS);
+	return NULL;
 }
 
 
@@ -336,8 +947,8 @@ int main (int argc, char* argv[]) {
 /*******************************************************************************
 Read buffer and forward data
 *******************************************************************************/
-static int ClearSocket (cinfo * c_ptr) {
-	int n = 0, bytes_to_read, m = 0, l = 0;
+static int ClearSocket (winfo * w, cinfo * c_ptr) {
+	int n = 0, bytes_to_read, m = 0, l = 0, closed = FALSE, peek;
 	char *bp, buf[BUFLEN];
 	int fd = c_ptr->fd;
 	int fd_pair = c_ptr->fd_pair;
@@ -345,13 +956,21 @@ static int ClearSocket (cinfo * c_ptr) {
 	// Confirm socket is connected
 	c_ptr->active = 1;
 	
+	// Data is still waiting for the peer or the peer is full, EPOLLOUT of
+	// the peer comes back here
+	if(c_ptr->buf != NULL || c_ptr->paused)
+		return TRUE;
+	
 	bytes_to_read = BUFLEN;
 	
 	// Edge-triggered event will only notify once, so we must
 	// read everything in the buffer
 	while(1){
 		
-		n = recv (fd, buf, bytes_to_read, 0);
+		// Over the relay budget for this priority no buffer can be taken,
+		// so only what the peer accepts is consumed
+		peek = relay_full(c_ptr->opts->priority);
+		n = STATS_CALL(STAGE_RECV, recv (fd, buf, bytes_to_read, peek ? MSG_PEEK : 0));
 	
 		// Read message
 		if(n > 0){
@@ -366,11 +985,18 @@ static int ClearSocket (cinfo * c_ptr) {
 			int bytes_to_send = n;
 			bp = buf;
 			while(1){
-				k = send(fd_pair, bp, bytes_to_send, 0);
+				k = STATS_CALL(STAGE_SEND, send(fd_pair, bp, bytes_to_send, 0));
 				printf ("Send (%d) bytes on fd %d\n", k, fd_pair);
 				if(k == -1){
-					if(errno == EAGAIN || errno == EWOULDBLOCK)
-						continue; // Send buffer full, keep looping
+					if(errno == EAGAIN || errno == EWOULDBLOCK){
+						// Send buffer full, keep the rest until the peer
+						// drains, or leave it queued when over the budget
+						if(peek)
+							relay_pause(w, c_ptr);
+						else
+							relay_stash(w, c_ptr, bp, bytes_to_send);
+						break;
+					}
 					else{
 						perror("send");
 						break;
@@ -387,23 +1013,49 @@ static int ClearSocket (cinfo * c_ptr) {
 					continue;
 				}
 			}
+			
+			// Take off the socket what was sent, or dropped on error
+			if(c_ptr->paused)
+				n -= bytes_to_send;
+			if(peek && n > 0 && STATS_CALL(STAGE_RECV, recv (fd, buf, n, 0)) != n){
+				perror("recv");
+				closed = TRUE;
+				break;
+			}
+			
+			// Stop reading until the rest was sent
+			if(c_ptr->buf != NULL || c_ptr->paused)
+				break;
 		}
 		// No more messages or read error
 		else if(n == -1){
-			if(errno != EAGAIN && errno != EWOULDBLOCK)
+			if(errno != EAGAIN && errno != EWOULDBLOCK){
 				perror("recv");
+				closed = TRUE;
+			}
 			
 			break;
 		}
 		// Zero-length message ,stream socket peer has performed an orderly shutdown
 		else{
 			printf ("Shutdown on fd %d\n", fd);
+			closed = TRUE;
 			break;
 		}
 	}
 	
+	STATS_BYTES(l);
+	
+	// The kernel drops out of quickack mode on its own, arm it again
+	if(c_ptr->opts != NULL && c_ptr->opts->quickack){
+		int arg = 1;
+		STATS_CALL(STAGE_SOCKOPT, setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &arg, sizeof(arg)));
+	}
+	
 	
-	if(m == 0){
+	// Nothing to read is not a reason to close: once a pair is offloaded
+	// the kernel consumes the data before we get to it
+	if(closed){
 		// Close socket
 		return FALSE;
 	}
@@ -428,9 +1080,11 @@ static void SystemFatal(const char* message) {
 Server closing function, signalled by CTRL-C. 
 *******************************************************************************/
 void close_server (int signo){
-    	int c = 0;
-    	for(;c < servers_size;c++){
-		close(servers[c]->fd);
+    	int c = 0, w = 0;
+    	for(;w < workers_size;w++){
+    		for(c = 0;c < workers[w].servers_size;c++){
+			close(workers[w].servers[c]->fd);
+		}
     	}
 	exit (EXIT_SUCCESS);
 }
@@ -438,14 +1092,1812 @@ void close_server (int signo){
 
 
 /*******************************************************************************
-Check if fd is a server socket.
+Parse a CPU list such as "0-3,8" into an array. Returns the number of CPUs or
+-1 if the list is malformed.
 *******************************************************************************/
-sinfo * is_server(int fd){
-	int c = 0;
-	for(;c < servers_size;c++){
-		if(servers[c]->fd == fd)
-			return servers[c];
+static int parse_cpus(const char * list, int ** out){
+	int size = 0, first, last;
+	const char * p = list;
+	char * end;
+
+	while(*p != '\0'){
+		first = last = (int)strtol(p, &end, 10);
+		if(end == p || first < 0)
+			return -1;
+		if(*end == '-'){
+			p = end + 1;
+			last = (int)strtol(p, &end, 10);
+			if(end == p || last < first)
+				return -1;
+		}
+		for(; first <= last; first++){
+			*out = realloc(*out, sizeof(int) * ++size);
+			(*out)[size-1] = first;
+		}
+		if(*end == ',')
+			end++;
+		else if(*end != '\0')
+			return -1;
+		p = end;
+	}
+	return size;
+}
+
+
+
+/*******************************************************************************
+Attach a classic BPF program to the reuseport group of fd that returns the
+index of the worker pinned to the CPU handling the SYN. CPUs without a worker
+return an out of range index, which makes the kernel fall back to hashing.
+*******************************************************************************/
+static void steer_listener(int fd){
+	struct sock_filter code[2 * MAX_WORKERS + 2];
+	struct sock_fprog prog;
+	int i, n = workers_size;
+
+	// A = CPU of the current packet
+	code[0] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+
+	// if (A == cpu_i) return i
+	for(i = 0; i < n; i++)
+		code[1 + i] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, workers[i].cpu, n, 0);
+	code[1 + n] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+	for(i = 0; i < n; i++)
+		code[2 + n + i] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+
+	prog.len = 2 * n + 2;
+	prog.filter = code;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1)
+		perror("setsockopt SO_ATTACH_REUSEPORT_CBPF");
+}
+
+
+
+/*******************************************************************************
+Raise the soft RLIMIT_NOFILE to the hard limit, before any listener is opened.
+*******************************************************************************/
+static void raise_nofile(void){
+	struct rlimit nofile;
+	
+	if(getrlimit(RLIMIT_NOFILE, &nofile) == -1){
+		perror("getrlimit");
+		return;
+	}
+	nofile.rlim_cur = nofile.rlim_max;
+	if(setrlimit(RLIMIT_NOFILE, &nofile) == -1)
+		perror("setrlimit");
+}
+
+
+
+/*******************************************************************************
+With -n, size the descriptor table for two per connection on top of what is
+open once listeners, epoll, control and offload descriptors and the spare
+exist, plus FD_SLACK. The hard limit is raised if it is lower and we have
+CAP_SYS_RESOURCE, and the table grown up front.
+*******************************************************************************/
+static void size_nofile(void){
+	struct rlimit nofile;
+	int fds = open_fds(), fd, top;
+	rlim_t want = fds + 2 * target_conns + FD_SLACK;
+	long conns;
+	
+	if(target_conns == 0)
+		return;
+	if(getrlimit(RLIMIT_NOFILE, &nofile) == -1){
+		perror("getrlimit");
+		return;
+	}
+	if(nofile.rlim_max != RLIM_INFINITY && nofile.rlim_max < want){
+		struct rlimit raised = { want, want };
+		if(setrlimit(RLIMIT_NOFILE, &raised) == 0)
+			nofile = raised;
+	}
+	if(nofile.rlim_cur < want){
+		fprintf(stderr, "RLIMIT_NOFILE is %ld with %d descriptors open, %ld connections need %ld\n",
+			(long)nofile.rlim_cur, fds, target_conns, (long)want);
+		want = nofile.rlim_cur;
+	}
+	// F_DUPFD never replaces a descriptor in use, unlike dup2
+	if((fd = open("/dev/null", O_RDONLY)) != -1){
+		if((top = fcntl(fd, F_DUPFD, want - 1)) != -1)
+			close(top);
+		close(fd);
+	}
+	conns = ((long)want - fds - FD_SLACK) / 2;
+	printf("RLIMIT_NOFILE %ld, %d descriptors open, table sized for %ld connections\n",
+		(long)nofile.rlim_cur, fds, conns > 0 ? conns : 0);
+}
+
+
+
+/*******************************************************************************
+Count the descriptors open in the process.
+*******************************************************************************/
+static int open_fds(void){
+	struct dirent * d;
+	DIR * dir;
+	int fds = -1;	// Less the one opendir holds
+	
+	if((dir = opendir("/proc/self/fd")) == NULL)
+		return 0;
+	while((d = readdir(dir)) != NULL){
+		if(d->d_name[0] != '.')
+			fds++;
+	}
+	closedir(dir);
+	return fds;
+}
+
+
+
+/*******************************************************************************
+Take a cinfo from the pool of the worker. The pool is only touched by the
+worker thread, so its pages come from the node the worker is pinned on.
+*******************************************************************************/
+static cinfo * cinfo_get(winfo * w){
+	cinfo * c_ptr;
+
+	if (w->pool_free == NULL)
+		pool_grow(w);
+
+	c_ptr = w->pool_free;
+	w->pool_free = c_ptr->next;
+	memset(c_ptr, 0, sizeof(cinfo));
+	return c_ptr;
+}
+
+
+
+/*******************************************************************************
+Add POOL_CHUNK cinfo to the pool of the worker.
+*******************************************************************************/
+static void pool_grow(winfo * w){
+	cinfo * chunk = malloc(sizeof(cinfo) * POOL_CHUNK);
+	int c;
+	
+	if (chunk == NULL)
+		SystemFatal("malloc");
+	memset(chunk, 0, sizeof(cinfo) * POOL_CHUNK);
+	w->pool_size += POOL_CHUNK;
+	for(c = 0; c < POOL_CHUNK; c++)
+		cinfo_put(w, &chunk[c]);
+}
+
+
+
+/*******************************************************************************
+Return a cinfo to the pool of the worker.
+*******************************************************************************/
+static void cinfo_put(winfo * w, cinfo * c_ptr){
+	c_ptr->next = w->pool_free;
+	w->pool_free = c_ptr;
+}
+
+
+
+/*******************************************************************************
+Close both sockets of a pair. The cinfo are only recycled after the current
+epoll batch since later events of the batch may still point to them.
+*******************************************************************************/
+static void close_pair(winfo * w, cinfo * c_ptr){
+	cinfo * p_ptr = c_ptr->pair;
+
+	if (c_ptr->flow != NULL || p_ptr != NULL)
+		w->conns--;
+	if (c_ptr->flow != NULL)
+		flow_remove(w, c_ptr->flow);
+	if (c_ptr->offloaded == TRUE || (p_ptr != NULL && p_ptr->offloaded == TRUE))
+		offload_release(c_ptr);
+	if (p_ptr != NULL && p_ptr->fd != -1)
+		close_relay(w, p_ptr);
+	close_relay(w, c_ptr);
+
+	STATS_CALL(STAGE_CLOSE, close(c_ptr->fd));
+	c_ptr->fd = -1;
+	c_ptr->next = w->pool_dead;
+	w->pool_dead = c_ptr;
+
+	if (p_ptr != NULL && p_ptr->fd != -1){
+		STATS_CALL(STAGE_CLOSE, close(p_ptr->fd));
+		p_ptr->fd = -1;
+		p_ptr->next = w->pool_dead;
+		w->pool_dead = p_ptr;
 	}
-	return NULL;
 }
 
+
+
+/*******************************************************************************
+Drop the relay state of one side of a pair that is being closed.
+*******************************************************************************/
+static void close_relay(winfo * w, cinfo * c_ptr){
+	if (c_ptr->paused){
+		c_ptr->paused = FALSE;
+		w->paused_size--;
+	}
+	if (c_ptr->buf != NULL)
+		relay_release(w, c_ptr);
+	if (c_ptr->connecting){
+		c_ptr->connecting = FALSE;
+		w->connecting--;
+	}
+}
+
+
+
+/*******************************************************************************
+TRUE when reads of the given priority can take no relay buffer: the relay
+buffers of all workers, plus one more, would go over the limit of that
+priority. Priority 0
+gives the high watermark. Always FALSE without -m.
+*******************************************************************************/
+static int relay_full(int priority){
+	return relay_budget != 0 && __atomic_load_n(&relay_used, __ATOMIC_RELAXED) + BUFLEN > relay_limits[priority];
+}
+
+
+
+/*******************************************************************************
+Keep the len bytes at data that could not be sent on fd_pair in the relay
+buffer of c_ptr, charged to the worker and the global budget, and ask for
+EPOLLOUT on fd_pair. EPOLLOUT stays armed, it is edge-triggered.
+*******************************************************************************/
+static void relay_stash(winfo * w, cinfo * c_ptr, const char * data, int len){
+	if((c_ptr->buf = malloc(BUFLEN)) == NULL)
+		SystemFatal("malloc");
+	memcpy(c_ptr->buf, data, len);
+	c_ptr->buf_off = 0;
+	c_ptr->buf_len = len;
+	w->buffered++;
+	w->relay += BUFLEN;
+	if(relay_budget)
+		__atomic_add_fetch(&relay_used, BUFLEN, __ATOMIC_RELAXED);
+	relay_arm(w, c_ptr);
+}
+
+
+
+/*******************************************************************************
+Ask for EPOLLOUT on fd_pair of c_ptr. EPOLLOUT stays armed, it is
+edge-triggered.
+*******************************************************************************/
+static void relay_arm(winfo * w, cinfo * c_ptr){
+	struct epoll_event event;
+	cinfo * p_ptr = c_ptr->pair;
+	
+	if(!p_ptr->out_armed){
+		event.events = EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP | EPOLLET;
+		event.data.ptr = (void *)p_ptr;
+		if(STATS_CALL(STAGE_SETUP, epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, p_ptr->fd, &event)) == -1)
+			SystemFatal("epoll_ctl");
+		p_ptr->out_armed = TRUE;
+	}
+}
+
+
+
+/*******************************************************************************
+Send the relay buffer of c_ptr on fd_pair after EPOLLOUT. Once it is empty the
+buffer goes back and reading c_ptr resumes. Returns FALSE if the pair must be
+closed.
+*******************************************************************************/
+static int relay_flush(winfo * w, cinfo * c_ptr){
+	int k;
+	
+	while(c_ptr->buf_len > 0){
+		k = STATS_CALL(STAGE_SEND, send(c_ptr->fd_pair, c_ptr->buf + c_ptr->buf_off, c_ptr->buf_len, 0));
+		printf ("Send (%d) bytes on fd %d\n", k, c_ptr->fd_pair);
+		if(k == -1){
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return TRUE;
+			perror("send");
+			return FALSE;
+		}
+		c_ptr->buf_off += k;
+		c_ptr->buf_len -= k;
+	}
+	
+	relay_release(w, c_ptr);
+	return relay_resume(w, c_ptr);
+}
+
+
+
+/*******************************************************************************
+Free the relay buffer of c_ptr and uncharge it.
+*******************************************************************************/
+static void relay_release(winfo * w, cinfo * c_ptr){
+	free(c_ptr->buf);
+	c_ptr->buf = NULL;
+	w->buffered--;
+	w->relay -= BUFLEN;
+	if(relay_budget)
+		__atomic_sub_fetch(&relay_used, BUFLEN, __ATOMIC_RELAXED);
+}
+
+
+
+/*******************************************************************************
+Stop reading c_ptr, over the relay budget, until fd_pair can take data again.
+What was not sent stays queued in the socket.
+*******************************************************************************/
+static void relay_pause(winfo * w, cinfo * c_ptr){
+	c_ptr->paused = TRUE;
+	w->paused_size++;
+	relay_arm(w, c_ptr);
+}
+
+
+
+/*******************************************************************************
+Read c_ptr again once fd_pair took its relay buffer or can take data. Returns
+FALSE if the pair must be closed.
+*******************************************************************************/
+static int relay_resume(winfo * w, cinfo * c_ptr){
+	if(c_ptr->paused){
+		c_ptr->paused = FALSE;
+		w->paused_size--;
+	}
+	
+	// Read what stayed queued meanwhile, no new edge reports it
+	if(!ClearSocket(w, c_ptr))
+		return FALSE;
+
+	// The pair was left in user space while it waited
+	if(offload && (c_ptr->offloaded == FALSE || c_ptr->offloaded == OFFLOAD_HASHED))
+		return offload_pair(w, c_ptr);
+	return TRUE;
+}
+
+
+
+/*******************************************************************************
+Open the upstream socket of a pair and start a non-blocking connect to the
+server of its rule with the given index, or to the next one that can be tried.
+The socket waits for EPOLLOUT, connect_done() takes it from there. Replaces the
+previous upstream socket, if any. Returns FALSE when no server is left.
+*******************************************************************************/
+static int connect_server(winfo * w, cinfo * c_ptr, int server){
+	const rinfo * rule = c_ptr->rule;
+	struct sockaddr_in addr = rule->server_addr;
+	struct epoll_event event;
+	int fd = -1, arg = 1, syncnt = CONNECT_SYNCNT, flags;
+	
+	for(; server < rule->servers_size; server++){
+		if((fd = STATS_CALL(STAGE_SETUP, socket(AF_INET, SOCK_STREAM, 0))) == -1){
+			perror("socket");
+			return FALSE;
+		}
+		
+		// Set SO_REUSEADDR so port can be reused immediately
+		if(STATS_CALL(STAGE_SOCKOPT, setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &arg, sizeof(arg))) == -1)
+			SystemFatal("setsockopt");
+		
+		// Make server socket non-blocking
+		flags = STATS_CALL(STAGE_SETUP, fcntl(fd, F_GETFL, 0));
+		if(STATS_CALL(STAGE_SETUP, fcntl(fd, F_SETFL, O_NONBLOCK | flags)) == -1)
+			SystemFatal("fcntl");
+		
+		// Apply rule options before connect so fastopen can carry the first data
+		set_topts(fd, rule->opts, SIDE_SERVER);
+		
+		// Give up on a silent server in seconds rather than minutes
+		if(STATS_CALL(STAGE_SOCKOPT, setsockopt(fd, IPPROTO_TCP, TCP_SYNCNT, &syncnt, sizeof(syncnt))) == -1)
+			SystemFatal("setsockopt");
+		
+		// A connect that completes at once is reported by EPOLLOUT as well
+		addr.sin_addr = rule->servers[server];
+		if(STATS_CALL(STAGE_CONNECT, connect(fd, (struct sockaddr *)&addr, sizeof(addr))) == 0 || errno == EINPROGRESS)
+			break;
+		
+		printf("Connect to %s:%d failed: %s\n", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), strerror(errno));
+		STATS_CALL(STAGE_CLOSE, close(fd));
+	}
+	if(server == rule->servers_size)
+		return FALSE;
+	
+	if(c_ptr->fd != -1)
+		STATS_CALL(STAGE_CLOSE, close(c_ptr->fd));
+	if(!c_ptr->connecting)
+		w->connecting++;
+	c_ptr->fd = fd;
+	c_ptr->server = server;
+	c_ptr->connecting = TRUE;
+	c_ptr->pair->fd_pair = fd;
+	
+	event.events = EPOLLOUT | EPOLLERR | EPOLLHUP | EPOLLET;
+	event.data.ptr = (void *)c_ptr;
+	if(STATS_CALL(STAGE_SETUP, epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &event)) == -1)
+		SystemFatal("epoll_ctl");
+	return TRUE;
+}
+
+
+
+/*******************************************************************************
+Finish the connect of an upstream socket once epoll reports it. On success the
+socket switches to EPOLLIN and whatever the client sent meanwhile is forwarded.
+On failure the next server of the rule is tried, the pair is closed when none
+is left.
+*******************************************************************************/
+static void connect_done(winfo * w, cinfo * c_ptr){
+	struct epoll_event event;
+	socklen_t len = sizeof(int);
+	int err = 0;
+	
+	if(STATS_CALL(STAGE_SOCKOPT, getsockopt(c_ptr->fd, SOL_SOCKET, SO_ERROR, &err, &len)) == -1)
+		err = errno;
+	
+	if(err != 0){
+		printf("Connect to %s:%d failed: %s\n", inet_ntoa(c_ptr->rule->servers[c_ptr->server]),
+			ntohs(c_ptr->rule->server_addr.sin_port), strerror(err));
+		if(!connect_server(w, c_ptr, c_ptr->server + 1))
+			close_pair(w, c_ptr);
+		return;
+	}
+	
+	c_ptr->connecting = FALSE;
+	c_ptr->active = 1;
+	w->connecting--;
+	
+	event.events = EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLET;
+	event.data.ptr = (void *)c_ptr;
+	if(STATS_CALL(STAGE_SETUP, epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, c_ptr->fd, &event)) == -1)
+		SystemFatal("epoll_ctl");
+	
+	// The client socket is edge-triggered, its early data will not be
+	// reported again
+	if(!ClearSocket(w, c_ptr->pair))
+		close_pair(w, c_ptr->pair);
+}
+
+
+
+/*******************************************************************************
+Parse a byte count with an optional k, m or g suffix. Returns -1 if malformed.
+*******************************************************************************/
+static long parse_size(const char * size){
+	char * end;
+	long value = strtol(size, &end, 10);
+	
+	if(end == size || value < 0)
+		return -1;
+	if(*end == 'k' || *end == 'K')
+		value <<= 10;
+	else if(*end == 'm' || *end == 'M')
+		value <<= 20;
+	else if(*end == 'g' || *end == 'G')
+		value <<= 30;
+	else if(*end != '\0')
+		return -1;
+	return end[*end != '\0'] == '\0' ? value : -1;
+}
+
+
+
+/*******************************************************************************
+Parse one option field of a config line into o. Returns FALSE if the option is
+unknown or its value is malformed.
+*******************************************************************************/
+static int parse_topt(const char * option, topts * o){
+	const char * value = strchr(option, '=');
+	
+	// Values start after the '=', numbers must take all of them
+	if(value != NULL)
+		value++;
+	
+	if(strcmp(option, "nodelay") == 0)
+		o->nodelay = 1;
+	else if(strcmp(option, "quickack") == 0)
+		o->quickack = 1;
+	else if(strcmp(option, "fastopen_connect") == 0)
+		o->fastopen_connect = 1;
+	else if(strcmp(option, "gro") == 0)
+		o->udp_gro = 1;
+	else if(value == NULL)
+		return FALSE;
+	else if(strncmp(option, "defer_accept=", 13) == 0)
+		return parse_number(&value, 1, INT_MAX, &o->defer_accept) && *value == '\0';
+	else if(strncmp(option, "fastopen=", 9) == 0)
+		return parse_number(&value, 1, INT_MAX, &o->fastopen) && *value == '\0';
+	else if(strncmp(option, "idle=", 5) == 0)
+		return parse_number(&value, 1, INT_MAX, &o->udp_idle) && *value == '\0';
+	else if(strncmp(option, "notsent_lowat=", 14) == 0)
+		return parse_number(&value, 1, INT_MAX, &o->notsent_lowat) && *value == '\0';
+	else if(strncmp(option, "priority=", 9) == 0)
+		return parse_number(&value, 0, PRIORITIES - 1, &o->priority) && *value == '\0';
+	else if(strncmp(option, "keepalive=", 10) == 0){
+		o->keepalive = 1;
+		return parse_number(&value, 1, INT_MAX, &o->keep_idle) && *value++ == ':'
+			&& parse_number(&value, 1, INT_MAX, &o->keep_intvl) && *value++ == ':'
+			&& parse_number(&value, 1, INT_MAX, &o->keep_cnt) && *value == '\0';
+	}
+	else
+		return FALSE;
+	
+	return TRUE;
+}
+
+
+
+/*******************************************************************************
+Parse a decimal number between min and max at *s into out and move *s past it.
+Returns FALSE if *s does not start with a digit or the number is out of range.
+*******************************************************************************/
+static int parse_number(const char ** s, long min, long max, int * out){
+	char * end;
+	long value;
+	
+	if(**s < '0' || **s > '9')
+		return FALSE;
+	errno = 0;
+	value = strtol(*s, &end, 10);
+	if(errno == ERANGE || value < min || value > max)
+		return FALSE;
+	*out = value;
+	*s = end;
+	return TRUE;
+}
+
+
+
+/*******************************************************************************
+Apply the TCP options of a rule to one socket of the rule, side is one of the
+SIDE_ definitions. Options the kernel rejects are reported but not fatal.
+An adopted listener still carries the options of the previous process, so
+they are set even when the rule leaves them off.
+*******************************************************************************/
+static void set_topts(int fd, const topts * o, int side){
+	int arg = 1;
+	
+	if(side == SIDE_LISTEN || side == SIDE_ADOPTED){
+		if((o->defer_accept || side == SIDE_ADOPTED) && STATS_CALL(STAGE_SOCKOPT, setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &o->defer_accept, sizeof(int))) == -1)
+			perror("setsockopt TCP_DEFER_ACCEPT");
+		if((o->fastopen || side == SIDE_ADOPTED) && STATS_CALL(STAGE_SOCKOPT, setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &o->fastopen, sizeof(int))) == -1)
+			perror("setsockopt TCP_FASTOPEN");
+		return;
+	}
+	
+	if(o->nodelay && STATS_CALL(STAGE_SOCKOPT, setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &arg, sizeof(arg))) == -1)
+		perror("setsockopt TCP_NODELAY");
+	if(o->quickack && STATS_CALL(STAGE_SOCKOPT, setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &arg, sizeof(arg))) == -1)
+		perror("setsockopt TCP_QUICKACK");
+	if(o->notsent_lowat && STATS_CALL(STAGE_SOCKOPT, setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &o->notsent_lowat, sizeof(int))) == -1)
+		perror("setsockopt TCP_NOTSENT_LOWAT");
+	if(side == SIDE_SERVER && o->fastopen_connect && STATS_CALL(STAGE_SOCKOPT, setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &arg, sizeof(arg))) == -1)
+		perror("setsockopt TCP_FASTOPEN_CONNECT");
+	if(o->keepalive){
+		if(STATS_CALL(STAGE_SOCKOPT, setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &arg, sizeof(arg))) == -1
+			|| STATS_CALL(STAGE_SOCKOPT, setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &o->keep_idle, sizeof(int))) == -1
+			|| STATS_CALL(STAGE_SOCKOPT, setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &o->keep_intvl, sizeof(int))) == -1
+			|| STATS_CALL(STAGE_SOCKOPT, setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &o->keep_cnt, sizeof(int))) == -1)
+			perror("setsockopt keepalive");
+	}
+}
+
+
+
+/*******************************************************************************
+Read every datagram queued on a UDP listener and forward each one on the flow
+of its client. Consecutive datagrams of the same flow go out in one sendmmsg.
+*******************************************************************************/
+static void udp_from_client(winfo * w, sinfo * s_ptr){
+	ubatch * b = w->batch;
+	int n, i, j;
+	
+	while(1){
+		batch_reset(b, s_ptr->rule->opts->udp_gro);
+		n = STATS_CALL(STAGE_RECV, recvmmsg(s_ptr->fd, b->msgs, UDP_BATCH, 0, NULL));
+		if (n == -1){
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("recvmmsg");
+			break;
+		}
+		
+		for (i = 0; i < n; i++){
+			b->flows[i] = flow_get(w, s_ptr, &b->addrs[i]);
+			
+			// Upstream socket is connected, send without an address
+			b->msgs[i].msg_hdr.msg_name = NULL;
+			b->msgs[i].msg_hdr.msg_namelen = 0;
+			b->iovs[i].iov_len = b->msgs[i].msg_len;
+			batch_segment(&b->msgs[i].msg_hdr);
+		}
+		
+		for (i = 0; i < n; i = j){
+			for (j = i + 1; j < n && b->flows[j] == b->flows[i]; j++)
+				;
+			if (b->flows[i] != NULL && STATS_CALL(STAGE_SEND, sendmmsg(b->flows[i]->c_ptr->fd, &b->msgs[i], j - i, 0)) == -1
+				&& errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED)
+				perror("sendmmsg");
+		}
+		
+		// Queue is drained, the next datagram raises a new edge
+		if (n < UDP_BATCH)
+			break;
+	}
+}
+
+
+
+/*******************************************************************************
+Read every reply queued on the upstream socket of a flow and send them back to
+the client of the flow through the listener of the rule.
+*******************************************************************************/
+static void udp_from_server(winfo * w, finfo * f){
+	ubatch * b = w->batch;
+	sinfo * s_ptr = f->server_info;
+	int n, i;
+	
+	while(1){
+		batch_reset(b, s_ptr->rule->opts->udp_gro);
+		n = STATS_CALL(STAGE_RECV, recvmmsg(f->c_ptr->fd, b->msgs, UDP_BATCH, 0, NULL));
+		if (n == -1){
+			// Server port unreachable, drop the flow
+			if (errno == ECONNREFUSED){
+				close_pair(w, f->c_ptr);
+				return;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("recvmmsg");
+			break;
+		}
+		
+		for (i = 0; i < n; i++){
+			b->msgs[i].msg_hdr.msg_name = &f->client;
+			b->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+			b->iovs[i].iov_len = b->msgs[i].msg_len;
+			batch_segment(&b->msgs[i].msg_hdr);
+		}
+		
+		if (n > 0 && STATS_CALL(STAGE_SEND, sendmmsg(s_ptr->fd, b->msgs, n, 0)) == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+			perror("sendmmsg");
+		
+		if (n < UDP_BATCH)
+			break;
+	}
+	
+	// Replies keep the flow alive too
+	flow_touch(w, f);
+}
+
+
+
+/*******************************************************************************
+Find the flow of a client on a UDP listener, creating it and its connected
+upstream socket on the first datagram. Returns NULL if the flow could not be
+created, in which case the datagram is dropped.
+*******************************************************************************/
+static finfo * flow_get(winfo * w, sinfo * s_ptr, struct sockaddr_in * client){
+	unsigned int h = flow_bucket(s_ptr, client);
+	struct epoll_event event;
+	finfo * f;
+	int fd, arg = 1, flags;
+	
+	for (f = w->flows[h]; f != NULL; f = f->hnext){
+		if (f->server_info == s_ptr && f->client.sin_addr.s_addr == client->sin_addr.s_addr
+			&& f->client.sin_port == client->sin_port)
+			break;
+	}
+	
+	if (f != NULL){
+		flow_touch(w, f);
+		return f;
+	}
+	
+	// New client, connect a socket to the server for it
+	if ((fd = STATS_CALL(STAGE_SETUP, socket(AF_INET, SOCK_DGRAM, 0))) == -1){
+		perror("socket");
+		return NULL;
+	}
+	flags = STATS_CALL(STAGE_SETUP, fcntl(fd, F_GETFL, 0));
+	if (STATS_CALL(STAGE_SETUP, fcntl(fd, F_SETFL, O_NONBLOCK | flags)) == -1
+		|| STATS_CALL(STAGE_CONNECT, connect(fd, (struct sockaddr *)&s_ptr->rule->server_addr, sizeof(struct sockaddr_in))) == -1){
+		perror("connect");
+		STATS_CALL(STAGE_CLOSE, close(fd));
+		return NULL;
+	}
+	if (s_ptr->rule->opts->udp_gro && STATS_CALL(STAGE_SOCKOPT, setsockopt(fd, SOL_UDP, UDP_GRO, &arg, sizeof(arg))) == -1)
+		perror("setsockopt UDP_GRO");
+	
+	if ((f = calloc(1, sizeof(finfo))) == NULL){
+		STATS_CALL(STAGE_CLOSE, close(fd));
+		return NULL;
+	}
+	f->client = *client;
+	f->server_info = s_ptr;
+	f->last = w->now;
+	f->c_ptr = cinfo_get(w);
+	f->c_ptr->fd = fd;
+	f->c_ptr->flow = f;
+	f->c_ptr->active = 1;
+	w->conns++;
+	
+	event.events = EPOLLIN | EPOLLERR | EPOLLET;
+	event.data.ptr = (void *)f->c_ptr;
+	if (STATS_CALL(STAGE_SETUP, epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &event)) == -1)
+		SystemFatal("epoll_ctl");
+	
+	f->hnext = w->flows[h];
+	w->flows[h] = f;
+	f->prev = s_ptr->idle_tail;
+	if (s_ptr->idle_tail != NULL)
+		s_ptr->idle_tail->next = f;
+	else
+		s_ptr->idle_head = f;
+	s_ptr->idle_tail = f;
+	
+	printf("UDP flow %s:%d on fd %d\n", inet_ntoa(client->sin_addr), ntohs(client->sin_port), fd);
+	return f;
+}
+
+
+
+/*******************************************************************************
+Mark a flow as used now by moving it to the tail of the idle list.
+*******************************************************************************/
+static void flow_touch(winfo * w, finfo * f){
+	sinfo * s_ptr = f->server_info;
+	
+	f->last = w->now;
+	if (f == s_ptr->idle_tail)
+		return;
+	
+	if (f->prev != NULL)
+		f->prev->next = f->next;
+	else
+		s_ptr->idle_head = f->next;
+	f->next->prev = f->prev;
+	f->prev = s_ptr->idle_tail;
+	f->next = NULL;
+	s_ptr->idle_tail->next = f;
+	s_ptr->idle_tail = f;
+}
+
+
+
+/*******************************************************************************
+Bucket of the flow table for a client of a UDP listener.
+*******************************************************************************/
+static unsigned int flow_bucket(sinfo * s_ptr, struct sockaddr_in * client){
+	return (client->sin_addr.s_addr * 2654435761u ^ client->sin_port ^ (unsigned int)s_ptr->fd)
+		& (FLOW_BUCKETS - 1);
+}
+
+
+
+/*******************************************************************************
+Unlink a flow from the flow table and the idle list, and free it. Called from
+close_pair(), which takes care of the upstream socket and its cinfo.
+*******************************************************************************/
+static void flow_remove(winfo * w, finfo * f){
+	sinfo * s_ptr = f->server_info;
+	unsigned int h = flow_bucket(s_ptr, &f->client);
+	finfo ** pp;
+	
+	for (pp = &w->flows[h]; *pp != f; pp = &(*pp)->hnext)
+		;
+	*pp = f->hnext;
+	
+	if (f->prev != NULL)
+		f->prev->next = f->next;
+	else
+		s_ptr->idle_head = f->next;
+	if (f->next != NULL)
+		f->next->prev = f->prev;
+	else
+		s_ptr->idle_tail = f->prev;
+	
+	f->c_ptr->flow = NULL;
+	free(f);
+}
+
+
+
+/*******************************************************************************
+Close the flows that saw no datagram for the idle time of their rule. Each
+idle list is ordered by last use, so only its head needs to be checked.
+*******************************************************************************/
+static void flow_expire(winfo * w){
+	int c;
+	
+	for (c = 0; c < w->servers_size; c++){
+		sinfo * s_ptr = w->servers[c];
+		while (s_ptr->idle_head != NULL && w->now - s_ptr->idle_head->last >= s_ptr->rule->opts->udp_idle){
+			printf("UDP flow expired on fd %d\n", s_ptr->idle_head->c_ptr->fd);
+			close_pair(w, s_ptr->idle_head->c_ptr);
+		}
+	}
+}
+
+
+
+/*******************************************************************************
+Point the message vectors of a batch back at their buffers for a receive.
+*******************************************************************************/
+static void batch_reset(ubatch * b, int gro){
+	int i;
+	
+	for (i = 0; i < UDP_BATCH; i++){
+		b->iovs[i].iov_base = b->bufs + (size_t)i * UDP_BUFLEN;
+		b->iovs[i].iov_len = UDP_BUFLEN;
+		b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+		b->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
+		b->msgs[i].msg_hdr.msg_control = gro ? b->cmsgs[i] : NULL;
+		b->msgs[i].msg_hdr.msg_controllen = gro ? sizeof(b->cmsgs[i]) : 0;
+		b->msgs[i].msg_hdr.msg_flags = 0;
+	}
+}
+
+
+
+/*******************************************************************************
+Turn the UDP_GRO control message of a received train into the UDP_SEGMENT
+control message that makes the kernel split it back into the same datagrams
+on send. Datagrams that were not coalesced are sent without control data.
+*******************************************************************************/
+static void batch_segment(struct msghdr * h){
+	struct cmsghdr * cm;
+	int gso_size = 0;
+	
+	for (cm = CMSG_FIRSTHDR(h); cm != NULL; cm = CMSG_NXTHDR(h, cm)){
+		if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+			memcpy(&gso_size, CMSG_DATA(cm), sizeof(int));
+	}
+	
+	if (gso_size == 0 || h->msg_iov->iov_len <= (size_t)gso_size){
+		h->msg_control = NULL;
+		h->msg_controllen = 0;
+		return;
+	}
+	
+	uint16_t segment = gso_size;
+	h->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+	cm = CMSG_FIRSTHDR(h);
+	cm->cmsg_level = SOL_UDP;
+	cm->cmsg_type = UDP_SEGMENT;
+	cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	memcpy(CMSG_DATA(cm), &segment, sizeof(uint16_t));
+}
+
+
+
+/*******************************************************************************
+Thin wrapper around the bpf system call.
+*******************************************************************************/
+static int sys_bpf(int cmd, union bpf_attr * attr){
+	return syscall(__NR_bpf, cmd, attr, sizeof(union bpf_attr));
+}
+
+
+
+/*******************************************************************************
+Create the offload maps, load the sk_skb programs and attach them to the
+sockhash. Returns FALSE with errno set if the kernel does not allow it.
+*******************************************************************************/
+static int offload_init(void){
+	union bpf_attr attr;
+	char log[4096];
+	int parser, verdict;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_SOCKHASH;
+	attr.key_size = sizeof(uint64_t);
+	attr.value_size = sizeof(int);
+	attr.max_entries = OFFLOAD_MAX;
+	if ((offload_socks = sys_bpf(BPF_MAP_CREATE, &attr)) == -1)
+		return FALSE;
+
+	attr.map_type = BPF_MAP_TYPE_HASH;
+	attr.value_size = sizeof(uint64_t);
+	if ((offload_peers = sys_bpf(BPF_MAP_CREATE, &attr)) == -1)
+		return FALSE;
+
+	// Parser: every segment is a message of its own length
+	struct bpf_insn parser_insns[] = {
+		BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_1, offsetof(struct __sk_buff, len), 0),
+		BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+
+	// Verdict: redirect to the socket whose cookie is stored for ours, or
+	// pass to user space while ours has no peer entry or that socket is not
+	// in the sockhash yet
+	struct bpf_insn verdict_insns[] = {
+		BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+		BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_socket_cookie),
+		BPF_INSN(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_0, -8, 0),
+		BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, offload_peers),
+		BPF_INSN(0, 0, 0, 0, 0),
+		BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+		BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8),
+		BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+		BPF_INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 10, 0),
+		BPF_INSN(BPF_LDX | BPF_MEM | BPF_DW, BPF_REG_3, BPF_REG_0, 0, 0),
+		BPF_INSN(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_3, -16, 0),
+		BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+		BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, offload_socks),
+		BPF_INSN(0, 0, 0, 0, 0),
+		BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+		BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -16),
+		BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+		BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash),
+		BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 1, 0),
+		BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+		BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+	attr.license = (uint64_t)(unsigned long)"GPL";
+	attr.log_buf = (uint64_t)(unsigned long)log;
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+
+	attr.insns = (uint64_t)(unsigned long)parser_insns;
+	attr.insn_cnt = sizeof(parser_insns) / sizeof(struct bpf_insn);
+	if ((parser = sys_bpf(BPF_PROG_LOAD, &attr)) == -1){
+		fprintf(stderr, "%s", log);
+		return FALSE;
+	}
+
+	attr.insns = (uint64_t)(unsigned long)verdict_insns;
+	attr.insn_cnt = sizeof(verdict_insns) / sizeof(struct bpf_insn);
+	if ((verdict = sys_bpf(BPF_PROG_LOAD, &attr)) == -1){
+		fprintf(stderr, "%s", log);
+		return FALSE;
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.target_fd = offload_socks;
+	attr.attach_bpf_fd = parser;
+	attr.attach_type = BPF_SK_SKB_STREAM_PARSER;
+	if (sys_bpf(BPF_PROG_ATTACH, &attr) == -1)
+		return FALSE;
+
+	attr.attach_bpf_fd = verdict;
+	attr.attach_type = BPF_SK_SKB_STREAM_VERDICT;
+	if (sys_bpf(BPF_PROG_ATTACH, &attr) == -1)
+		return FALSE;
+
+	printf("Kernel offload enabled\n");
+	return TRUE;
+}
+
+
+
+/*******************************************************************************
+Splice a pair in the kernel, one direction at a time. Both sockets first go in
+the sockhash, where the verdict passes their data to user space as long as
+they have no peer entry. Each side is then drained with ClearSocket() and only
+gets its peer entry, which turns on the redirect of its reads, once nothing of
+it is left in user space: no relay buffer, not paused and an empty read. A
+side that is not drained yet is tried again on its next drain.
+Sockets can only be added once established, so a pair whose connect is still
+in progress is tried again on its next event. Any other error leaves the side
+in user space for good. Sockets never leave the sockhash before they are
+closed, that would drop what the verdict passed to user space.
+Bytes that arrive between the last empty read and the peer entry are still
+passed to user space, and the bytes after them are redirected ahead of them.
+The window is the one map update wide and is not closed.
+Returns FALSE if the pair must be closed.
+*******************************************************************************/
+static int offload_pair(winfo * w, cinfo * c_ptr){
+	cinfo * p_ptr = c_ptr->pair;
+	union bpf_attr attr;
+	socklen_t len = sizeof(uint64_t);
+	cinfo * sides[2];
+	int c, fd;
+
+	if (p_ptr == NULL || c_ptr->offloaded == OFFLOAD_FAILED || p_ptr->offloaded == OFFLOAD_FAILED)
+		return TRUE;
+	sides[0] = c_ptr;
+	sides[1] = p_ptr;
+
+	for (c = 0; c < 2; c++){
+		if (sides[c]->offloaded != FALSE)
+			continue;
+		fd = sides[c]->fd;
+		if (STATS_CALL(STAGE_SOCKOPT, getsockopt(fd, SOL_SOCKET, SO_COOKIE, &sides[c]->cookie, &len)) == -1){
+			sides[c]->offloaded = OFFLOAD_FAILED;
+			return TRUE;
+		}
+		memset(&attr, 0, sizeof(attr));
+		attr.map_fd = offload_socks;
+		attr.key = (uint64_t)(unsigned long)&sides[c]->cookie;
+		attr.value = (uint64_t)(unsigned long)&fd;
+		attr.flags = BPF_ANY;
+		if (STATS_CALL(STAGE_OFFLOAD, sys_bpf(BPF_MAP_UPDATE_ELEM, &attr)) == -1){
+			// Not established yet, try again on the next event
+			if (errno != EOPNOTSUPP){
+				perror("offload");
+				sides[c]->offloaded = OFFLOAD_FAILED;
+			}
+			return TRUE;
+		}
+		sides[c]->offloaded = OFFLOAD_HASHED;
+	}
+
+	for (c = 0; c < 2; c++){
+		cinfo * s_ptr = sides[c];
+		if (s_ptr->offloaded != OFFLOAD_HASHED)
+			continue;
+		
+		// Forward what the verdict passed to user space so far
+		if (!ClearSocket(w, s_ptr))
+			return FALSE;
+		if (s_ptr->buf != NULL || s_ptr->paused)
+			continue;
+		
+		memset(&attr, 0, sizeof(attr));
+		attr.map_fd = offload_peers;
+		attr.key = (uint64_t)(unsigned long)&s_ptr->cookie;
+		attr.value = (uint64_t)(unsigned long)&sides[1 - c]->cookie;
+		if (STATS_CALL(STAGE_OFFLOAD, sys_bpf(BPF_MAP_UPDATE_ELEM, &attr)) == -1){
+			perror("offload");
+			s_ptr->offloaded = OFFLOAD_FAILED;
+			continue;
+		}
+		s_ptr->offloaded = TRUE;
+	}
+
+	if (c_ptr->offloaded == TRUE && p_ptr->offloaded == TRUE)
+		printf("Offloaded fd %d <-> fd %d\n", c_ptr->fd, p_ptr->fd);
+	return TRUE;
+}
+
+
+
+/*******************************************************************************
+Drop the peer entries of a pair. The sockhash entries go away by themselves
+when the sockets are closed.
+*******************************************************************************/
+static void offload_release(cinfo * c_ptr){
+	union bpf_attr attr;
+	cinfo * p_ptr = c_ptr->pair;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = offload_peers;
+	attr.key = (uint64_t)(unsigned long)&c_ptr->cookie;
+	STATS_CALL(STAGE_OFFLOAD, sys_bpf(BPF_MAP_DELETE_ELEM, &attr));
+	if (p_ptr != NULL){
+		attr.key = (uint64_t)(unsigned long)&p_ptr->cookie;
+		STATS_CALL(STAGE_OFFLOAD, sys_bpf(BPF_MAP_DELETE_ELEM, &attr));
+	}
+	c_ptr->offloaded = FALSE;
+	if (p_ptr != NULL)
+		p_ptr->offloaded = FALSE;
+}
+
+
+
+/*******************************************************************************
+Add a listening socket to the server list and the epoll event loop of a worker.
+*******************************************************************************/
+static void add_server(winfo * w, sinfo * s_ptr){
+	struct epoll_event event;
+	
+	if (s_ptr->rule->type == SOCK_DGRAM)
+		w->udp = TRUE;
+	
+	w->servers = realloc(w->servers,sizeof(sinfo *) * ++w->servers_size);
+	w->servers[w->servers_size-1] = s_ptr;
+	
+	// Add the server socket to the epoll event loop with it's data
+	event.events = EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLET;
+	
+	cinfo * server_cinfo = calloc(1, sizeof(cinfo));
+	server_cinfo->fd = s_ptr->fd;
+	server_cinfo->server_info = s_ptr;
+	s_ptr->listen_info = server_cinfo;
+	event.data.ptr = (void *)server_cinfo;
+	
+	if (epoll_ctl (w->epoll_fd, EPOLL_CTL_ADD, s_ptr->fd, &event) == -1)
+		SystemFatal("epoll_ctl");
+}
+
+
+
+/*******************************************************************************
+Take the listener added last back out of a worker and close it.
+*******************************************************************************/
+static void remove_server(winfo * w){
+	sinfo * s_ptr = w->servers[--w->servers_size];
+	
+	if (epoll_ctl (w->epoll_fd, EPOLL_CTL_DEL, s_ptr->fd, NULL) == -1)
+		perror("epoll_ctl");
+	close(s_ptr->fd);
+	free(s_ptr->listen_info);
+	free(s_ptr);
+}
+
+
+
+/*******************************************************************************
+Take the inherited listener bound to port at index of its reuseport group, or
+return -1 if there is none. The inherited listeners are sorted by type, port
+and index.
+*******************************************************************************/
+static int adopt_listener(int port, int type, int index){
+	int low = 0, high = inherited_size, mid, fd;
+	linfo key;
+	
+	key.port = port;
+	key.type = type;
+	key.index = index;
+	while(low < high){
+		mid = (low + high) / 2;
+		if(compare_linfo(&inherited[mid], &key) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	
+	if(low == inherited_size || compare_linfo(&inherited[low], &key) != 0 || inherited[low].fd == -1)
+		return -1;
+	fd = inherited[low].fd;
+	inherited[low].fd = -1;
+	return fd;
+}
+
+
+
+/*******************************************************************************
+Order linfo by type, port then index.
+*******************************************************************************/
+static int compare_linfo(const void * a, const void * b){
+	const linfo * x = a, * y = b;
+	
+	if(x->type != y->type)
+		return x->type - y->type;
+	if(x->port != y->port)
+		return x->port - y->port;
+	return x->index - y->index;
+}
+
+
+
+/*******************************************************************************
+Connect to the control socket of the running process and receive all of its
+listeners. The connection stays open until we are ready to accept.
+*******************************************************************************/
+static void upgrade_receive(const char * path){
+	struct sockaddr_un un;
+	linfo l;
+	
+	memset(&un, 0, sizeof(un));
+	un.sun_family = AF_UNIX;
+	strncpy(un.sun_path, path, sizeof(un.sun_path) - 1);
+	if((upgrade_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		SystemFatal("socket");
+	if(connect(upgrade_fd, (struct sockaddr *)&un, sizeof(un)) == -1)
+		SystemFatal("upgrade connect");
+	
+	while(1){
+		char control[CMSG_SPACE(sizeof(int))];
+		struct iovec iov = { &l, sizeof(l) };
+		struct msghdr msg;
+		struct cmsghdr * cm;
+		
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		
+		if(recvmsg(upgrade_fd, &msg, MSG_WAITALL) != sizeof(l))
+			SystemFatal("upgrade recvmsg");
+		
+		// Terminating record carries no descriptor
+		if((cm = CMSG_FIRSTHDR(&msg)) == NULL)
+			break;
+		if(cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+			SystemFatal("upgrade cmsg");
+		memcpy(&l.fd, CMSG_DATA(cm), sizeof(int));
+		
+		inherited = realloc(inherited, sizeof(linfo) * ++inherited_size);
+		inherited[inherited_size-1] = l;
+	}
+	
+	qsort(inherited, inherited_size, sizeof(linfo), compare_linfo);
+	printf("Received %d listeners from %s\n", inherited_size, path);
+}
+
+
+
+/*******************************************************************************
+Serve the control socket. Hands the listeners over to the first process that
+confirms it is ready, then makes the workers stop accepting.
+*******************************************************************************/
+void * upgrade_loop(void * arg){
+	uint64_t one = 1;
+	char ready;
+	int fd;
+	
+	while(1){
+		if((fd = accept(control_fd, NULL, NULL)) == -1){
+			if(errno == EINTR)
+				continue;
+			perror("control accept");
+			return NULL;
+		}
+		
+		printf("Upgrade requested, handing listeners over\n");
+		
+		// A new process that dies before it is ready leaves us serving
+		if(upgrade_send(fd) && recv(fd, &ready, 1, 0) == 1){
+			close(fd);
+			break;
+		}
+		printf("Upgrade aborted, still accepting\n");
+		close(fd);
+	}
+	
+	close(control_fd);
+	if(write(drain_fd, &one, sizeof(one)) != sizeof(one))
+		perror("eventfd write");
+	return NULL;
+}
+
+
+
+/*******************************************************************************
+Send every listener of every worker over fd, one per message, followed by a
+record without descriptor. Returns FALSE if the new process went away.
+*******************************************************************************/
+static int upgrade_send(int fd){
+	int w, c;
+	linfo l;
+	
+	for(w = 0; w < workers_size; w++){
+		for(c = 0; c < workers[w].servers_size; c++){
+			char control[CMSG_SPACE(sizeof(int))];
+			struct iovec iov = { &l, sizeof(l) };
+			struct msghdr msg;
+			struct cmsghdr * cm;
+			
+			l.fd = workers[w].servers[c]->fd;
+			l.port = workers[w].servers[c]->rule->port;
+			l.type = workers[w].servers[c]->rule->type;
+			l.index = workers[w].servers[c]->index;
+			
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			cm = CMSG_FIRSTHDR(&msg);
+			cm->cmsg_level = SOL_SOCKET;
+			cm->cmsg_type = SCM_RIGHTS;
+			cm->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cm), &l.fd, sizeof(int));
+			
+			if(sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(l))
+				return FALSE;
+		}
+	}
+	
+	l.fd = -1;
+	return send(fd, &l, sizeof(l), MSG_NOSIGNAL) == sizeof(l);
+}
+
+
+
+/*******************************************************************************
+Stop accepting on the listeners of a worker. TCP listeners are closed, our
+copy only, the new process keeps them open. UDP listeners stay open to send
+replies of the remaining flows but are no longer read.
+*******************************************************************************/
+static void stop_servers(winfo * w){
+	int c;
+	
+	STATS_CALL(STAGE_CLOSE, epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, drain_fd, NULL));
+	for(c = 0; c < w->servers_size; c++){
+		sinfo * s_ptr = w->servers[c];
+		if (STATS_CALL(STAGE_CLOSE, epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, s_ptr->fd, NULL)) == -1)
+			perror("epoll_ctl");
+		if (s_ptr->rule->type == SOCK_STREAM){
+			STATS_CALL(STAGE_CLOSE, close(s_ptr->fd));
+			s_ptr->fd = -1;
+		}
+	}
+	w->stopped = TRUE;
+	printf("Worker %d stopped accepting, %d connections left\n", w->id, w->conns);
+}
+
+
+
+/*******************************************************************************
+Refuse the next pending connection of a listener after accept failed for lack
+of descriptors: give up the spare, accept and close the connection, then take
+the spare again. All workers share one descriptor table, hence one spare under
+a lock. Another thread may still take the freed slot first, returns FALSE when
+the connection could not be refused.
+*******************************************************************************/
+static int spare_refuse(int fd){
+	int fd_new = -1;
+	
+	pthread_mutex_lock(&spare_lock);
+	if (spare_fd != -1){
+		STATS_CALL(STAGE_CLOSE, close(spare_fd));
+		fd_new = STATS_CALL(STAGE_ACCEPT, accept(fd, NULL, NULL));
+		if (fd_new != -1)
+			STATS_CALL(STAGE_CLOSE, close(fd_new));
+		__atomic_store_n(&spare_fd, STATS_CALL(STAGE_SETUP, open("/dev/null", O_RDONLY | O_CLOEXEC)), __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&spare_lock);
+	return fd_new != -1;
+}
+
+
+
+/*******************************************************************************
+Open the spare again if a refusal could not. Returns FALSE while there is no
+descriptor for it.
+*******************************************************************************/
+static int spare_reopen(void){
+	int ok;
+	
+	if (__atomic_load_n(&spare_fd, __ATOMIC_RELAXED) != -1)
+		return TRUE;
+	pthread_mutex_lock(&spare_lock);
+	if (spare_fd == -1)
+		__atomic_store_n(&spare_fd, STATS_CALL(STAGE_SETUP, open("/dev/null", O_RDONLY | O_CLOEXEC)), __ATOMIC_RELAXED);
+	ok = (spare_fd != -1);
+	pthread_mutex_unlock(&spare_lock);
+	return ok;
+}
+
+
+
+/*******************************************************************************
+Re-arm the listeners left with a connection they could not refuse. The
+modification reports them again since the connection is still pending, and the
+accept loop takes it from there.
+*******************************************************************************/
+static void listener_rearm(winfo * w){
+	struct epoll_event event;
+	int c;
+	
+	for(c = 0; c < w->servers_size; c++){
+		sinfo * s_ptr = w->servers[c];
+		if (!s_ptr->stalled)
+			continue;
+		event.events = EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLET;
+		event.data.ptr = (void *)s_ptr->listen_info;
+		if (STATS_CALL(STAGE_SETUP, epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, s_ptr->fd, &event)) == -1)
+			SystemFatal("epoll_ctl");
+		s_ptr->stalled = FALSE;
+	}
+	w->stalled = FALSE;
+}
+
+
+
+/*******************************************************************************
+Read the config file into the rule table, one line at a time. Every field is
+checked, port ranges are expanded into one rule per port and each server is
+resolved once. Any error stops the forwarder with the offending line.
+*******************************************************************************/
+static void load_rules(const char * path){
+	FILE * fp;
+	ssize_t read;
+	size_t len = 0;
+	char * line = NULL, * last_server = NULL;
+	struct in_addr * last_servers = NULL;
+	int last_servers_size = 0;
+	int line_no = 0;
+	
+	if((fp = fopen(path, "r")) == NULL)
+		SystemFatal(path);
+	rule_index[0] = calloc(PORTS, sizeof(uint32_t));
+	rule_index[1] = calloc(PORTS, sizeof(uint32_t));
+	if(rule_index[0] == NULL || rule_index[1] == NULL)
+		SystemFatal("calloc");
+	
+	while((read = getline(&line, &len, fp)) != -1){
+		char * config[CONFIG_FIELDS], * token, * rest = line, * hash;
+		int config_index = 0, first, last, server_first, server_last, type, c, port;
+		
+		line_no++;
+		if((hash = strchr(line, '#')) != NULL)
+			*hash = '\0';
+		
+		// Tokenize each line into array, trimming blanks around fields.
+		// strsep keeps empty fields, which strtok would merge away
+		while((token = strsep(&rest, ",")) != NULL){
+			char * end;
+			while(*token == ' ' || *token == '\t')
+				token++;
+			for(end = token + strlen(token); end > token && strchr(" \t\r\n", end[-1]) != NULL; end--)
+				;
+			*end = '\0';
+			if(config_index == CONFIG_FIELDS)
+				config_error(path, line_no, "more than %d fields", CONFIG_FIELDS);
+			config[config_index++] = token;
+		}
+		if(config_index == 1 && *config[0] == '\0')
+			continue;
+		for(c = 0; c < config_index; c++){
+			if(*config[c] == '\0')
+				config_error(path, line_no, "field %d is empty", c + 1);
+		}
+		if(config_index < 3)
+			config_error(path, line_no, "expected <port>,<server>,<server_port>[,<option>...]");
+		
+		if(!parse_ports(config[0], &first, &last, &type))
+			config_error(path, line_no, "invalid port \"%s\"", config[0]);
+		if(!parse_ports(config[2], &server_first, &server_last, NULL))
+			config_error(path, line_no, "invalid server port \"%s\"", config[2]);
+		if(server_first != server_last && server_last - server_first != last - first)
+			config_error(path, line_no, "server port range must be one port or as long as the port range");
+		
+		// Remaining fields are options, shared by all ports of the line
+		topts * opts = calloc(1, sizeof(topts));
+		for(c = 3; c < config_index; c++){
+			if(!parse_topt(config[c], opts))
+				config_error(path, line_no, "invalid option \"%s\"", config[c]);
+		}
+		if(type == SOCK_STREAM && (opts->udp_idle || opts->udp_gro))
+			config_error(path, line_no, "idle and gro only apply to /udp rules");
+		if(type == SOCK_DGRAM && (opts->nodelay || opts->quickack || opts->defer_accept || opts->keepalive
+			|| opts->fastopen || opts->fastopen_connect || opts->notsent_lowat || opts->priority))
+			config_error(path, line_no, "TCP option on a /udp rule");
+		if(opts->udp_idle == 0)
+			opts->udp_idle = UDP_IDLE;
+		
+		// Consecutive lines usually share their servers, resolve them once
+		if(last_server == NULL || strcmp(last_server, config[1]) != 0){
+			if((last_servers_size = resolve_servers(config[1], &last_servers)) == 0)
+				config_error(path, line_no, "cannot resolve \"%s\"", config[1]);
+			if(last_servers_size > MAX_SERVERS)
+				config_error(path, line_no, "more than %d servers", MAX_SERVERS);
+			free(last_server);
+			last_server = strdup(config[1]);
+		}
+		if(opts->fastopen_connect && last_servers_size > 1)
+			config_error(path, line_no, "fastopen_connect cannot fail over, use a single server");
+		
+		for(port = first; port <= last; port++){
+			uint32_t * index = &rule_index[PROTO(type)][port];
+			if(*index != 0)
+				config_error(path, line_no, "port %d already forwarded on line %d", port, rules[*index - 1].line);
+			
+			if(rules_size == rules_max){
+				rules_max = rules_max ? rules_max * 2 : 64;
+				if((rules = realloc(rules, sizeof(rinfo) * rules_max)) == NULL)
+					SystemFatal("realloc");
+			}
+			
+			rinfo * r = &rules[rules_size];
+			memset(r, 0, sizeof(rinfo));
+			r->server_addr.sin_family = AF_INET;
+			r->server_addr.sin_addr = last_servers[0];
+			r->server_addr.sin_port = htons(server_first == server_last ? server_first : server_first + port - first);
+			r->opts = opts;
+			r->servers = last_servers;
+			r->servers_size = last_servers_size;
+			r->port = port;
+			r->type = type;
+			r->line = line_no;
+			*index = ++rules_size;
+		}
+		
+		printf("Forwarding port %s%s to %s:%s\n", config[0], type == SOCK_DGRAM && strchr(config[0], '/') == NULL ? "/udp" : "", config[1], config[2]);
+	}
+	
+	free(last_server);
+	free(line);
+	fclose(fp);
+}
+
+
+
+/*******************************************************************************
+Parse a port or port range, optionally followed by /tcp or /udp when type is
+not NULL. Returns FALSE if the field is malformed.
+*******************************************************************************/
+static int parse_ports(char * field, int * first, int * last, int * type){
+	const char * end = field;
+	
+	if(!parse_number(&end, 1, PORTS - 1, first))
+		return FALSE;
+	*last = *first;
+	
+	if(*end == '-'){
+		end++;
+		if(!parse_number(&end, *first, PORTS - 1, last))
+			return FALSE;
+	}
+	
+	if(type == NULL)
+		return *end == '\0';
+	
+	*type = SOCK_STREAM;
+	if(strcmp(end, "/udp") == 0)
+		*type = SOCK_DGRAM;
+	else if(*end != '\0' && strcmp(end, "/tcp") != 0)
+		return FALSE;
+	return TRUE;
+}
+
+
+
+/*******************************************************************************
+Resolve a server field, one or more hosts separated by |, into a new array.
+Returns the number of hosts, 0 if one of them cannot be resolved.
+*******************************************************************************/
+static int resolve_servers(const char * field, struct in_addr ** servers){
+	char * hosts, * host, * save;
+	int size = 0;
+	
+	if((hosts = strdup(field)) == NULL)
+		SystemFatal("strdup");
+	*servers = NULL;
+	for(host = strtok_r(hosts, "|", &save); host != NULL; host = strtok_r(NULL, "|", &save)){
+		struct hostent * hp;
+		struct in_addr addr;
+		
+		if(inet_aton(host, &addr) == 0){
+			if((hp = gethostbyname(host)) == NULL || hp->h_addrtype != AF_INET){
+				size = 0;
+				break;
+			}
+			bcopy(hp->h_addr, (char *)&addr, sizeof(addr));
+		}
+		if((*servers = realloc(*servers, sizeof(struct in_addr) * (size + 1))) == NULL)
+			SystemFatal("realloc");
+		(*servers)[size++] = addr;
+	}
+	
+	free(hosts);
+	return size;
+}
+
+
+
+/*******************************************************************************
+Report an error in the config file and exit.
+*******************************************************************************/
+static void config_error(const char * path, int line, const char * format, ...){
+	va_list args;
+	
+	fprintf(stderr, "%s:%d: ", path, line);
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	fprintf(stderr, "\n");
+	exit (EXIT_FAILURE);
+}
+
+
+
+/*******************************************************************************
+Create, or adopt from the previous process, the listener of a rule for a
+worker. Returns -1 after reporting the error if the socket cannot be set up.
+*******************************************************************************/
+static int open_listener(rinfo * r, winfo * w){
+	int fd_server, adopted = TRUE, arg = 1;
+	
+	// Reuse a listener of the previous process if it had one
+	if ((fd_server = adopt_listener(r->port, r->type, w->id)) == -1){
+		adopted = FALSE;
+		if ((fd_server = socket (AF_INET, r->type, 0)) == -1)
+			return listener_error(r, w, fd_server, "socket");
+	}
+	
+	// set SO_REUSEADDR so port can be reused immediately after exit, i.e., after CTRL-c
+	if (setsockopt (fd_server, SOL_SOCKET, SO_REUSEADDR, &arg, sizeof(arg)) == -1)
+		return listener_error(r, w, fd_server, "setsockopt");
+	
+	// Let every worker, and the process upgrading us, bind its own
+	// listener to the same port
+	if ((workers_size > 1 || control_path != NULL) && setsockopt (fd_server, SOL_SOCKET, SO_REUSEPORT, &arg, sizeof(arg)) == -1)
+		return listener_error(r, w, fd_server, "setsockopt");
+	
+	// Prefer the listener of the worker pinned to the receiving CPU
+	if (w->cpu != -1 && setsockopt (fd_server, SOL_SOCKET, SO_INCOMING_CPU, &w->cpu, sizeof(w->cpu)) == -1)
+		perror("setsockopt SO_INCOMING_CPU");
+	
+	listener_opts(r, fd_server, adopted);
+	
+	// Make the server listening socket non-blocking
+	if (fcntl (fd_server, F_SETFL, O_NONBLOCK | fcntl (fd_server, F_GETFL, 0)) == -1)
+		return listener_error(r, w, fd_server, "fcntl");
+	
+	// Bind to the specified listening port
+	struct sockaddr_in addr;
+	memset (&addr, 0, sizeof (struct sockaddr_in));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(r->port);
+	
+	if (!adopted && bind (fd_server, (struct sockaddr*) &addr, sizeof(addr)) == -1)
+		return listener_error(r, w, fd_server, "bind");
+	
+	// Listen for fd_news; SOMAXCONN is 128 by default
+	if (r->type == SOCK_STREAM && listen (fd_server, SOMAXCONN) == -1)
+		return listener_error(r, w, fd_server, "listen");
+	
+	return fd_server;
+}
+
+
+
+/*******************************************************************************
+Apply the options of a rule to its listener. Options of an adopted listener are
+all set, so those the rule dropped since the previous process are cleared.
+*******************************************************************************/
+static void listener_opts(rinfo * r, int fd, int adopted){
+	if (r->type == SOCK_STREAM)
+		set_topts(fd, r->opts, adopted ? SIDE_ADOPTED : SIDE_LISTEN);
+	else if ((r->opts->udp_gro || adopted) && setsockopt (fd, SOL_UDP, UDP_GRO, &r->opts->udp_gro, sizeof(int)) == -1)
+		perror("setsockopt UDP_GRO");
+}
+
+
+
+/*******************************************************************************
+Report why the listener of a rule could not be set up, close it and return -1.
+*******************************************************************************/
+static int listener_error(rinfo * r, winfo * w, int fd, const char * step){
+	fprintf(stderr, "Port %d%s (line %d) on worker %d: %s: %s\n", r->port, r->type == SOCK_DGRAM ? "/udp" : "",
+		r->line, w->id, step, strerror(errno));
+	if (fd != -1)
+		close(fd);
+	return -1;
+}
+
+
+
+/*******************************************************************************
+Wait for SIGUSR1 and print the gauges of every worker, and their counters when
+built with PF_STATS. Gauges are read while the workers update them.
+*******************************************************************************/
+void * report_loop(void * arg){
+	sigset_t usr1;
+	int sig, i;
+	long relay;
+	struct rlimit nofile;
+	
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	
+	while(sigwait(&usr1, &sig) == 0){
+		relay = 0;
+		for(i = 0; i < workers_size; i++){
+			winfo * w = &workers[i];
+			
+			printf("Worker %d: %d pairs, %d connecting, %d paused, %d relay buffers (%ld bytes), %ld refused, %ld cinfo (%ld bytes)\n",
+				i, w->conns, w->connecting, w->paused_size, w->buffered, w->relay, w->refused,
+				w->pool_size, w->pool_size * (long)sizeof(cinfo));
+			relay += w->relay;
+#ifdef PF_STATS
+			stats_dump(w);
+#endif
+		}
+		
+		if(relay_budget)
+			printf("Relay buffers: %ld bytes, high watermark %ld, budget %ld\n", relay, relay_limits[0], relay_budget);
+		else
+			printf("Relay buffers: %ld bytes, no budget\n", relay);
+		
+		getrlimit(RLIMIT_NOFILE, &nofile);
+		printf("Descriptors: %d open, limit %ld\n", open_fds(), (long)nofile.rlim_cur);
+		fflush(stdout);
+	}
+	return NULL;
+}
+
+
+
+#ifdef PF_STATS
+/*******************************************************************************
+Current cycle count, or nanoseconds where there is no cycle counter.
+*******************************************************************************/
+static inline uint64_t stats_now(void){
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+
+
+/*******************************************************************************
+log2 bucket of a value, 0 and 1 share bucket 0.
+*******************************************************************************/
+static inline int stats_bucket(uint64_t value){
+	int b = 63 - __builtin_clzll(value | 1);
+	return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+
+
+/*******************************************************************************
+Account one syscall of a stage that started at start. Setup done by the main
+thread before the workers run is not counted.
+*******************************************************************************/
+static inline void stats_stage(int stage, uint64_t start){
+	uint64_t cycles = stats_now() - start;
+	
+	if(stats_local == NULL)
+		return;
+	stats_local->calls[stage]++;
+	stats_local->cycles[stage] += cycles;
+	stats_local->stage_hist[stage][stats_bucket(cycles)]++;
+	stats_local->iteration++;
+}
+
+
+
+/*******************************************************************************
+Account an epoll_wait return, which also closes the previous iteration.
+*******************************************************************************/
+static void stats_wakeup(int num_fds){
+	stats_local->wakeups++;
+	if(num_fds == epoll_events)
+		stats_local->full++;
+	stats_local->events_hist[stats_bucket(num_fds)]++;
+	stats_local->syscalls_hist[stats_bucket(stats_local->iteration)]++;
+	stats_local->iteration = 0;
+}
+
+
+
+/*******************************************************************************
+Account the bytes moved by one ClearSocket call.
+*******************************************************************************/
+static void stats_bytes(int bytes){
+	stats_local->bytes_hist[stats_bucket(bytes)]++;
+}
+
+
+
+/*******************************************************************************
+Print the non empty buckets of a histogram as [low,high):count.
+*******************************************************************************/
+static void stats_hist(const char * name, const uint64_t * hist){
+	int b;
+	
+	printf("  %-14s", name);
+	for(b = 0; b < STATS_BUCKETS; b++){
+		if(hist[b] != 0)
+			printf(" [%llu,%llu):%llu", b ? 1ULL << b : 0ULL, 1ULL << (b + 1), (unsigned long long)hist[b]);
+	}
+	printf("\n");
+}
+
+
+
+/*******************************************************************************
+Print the counters of a worker. They are read while the worker updates them,
+a dump may be off by a few events.
+*******************************************************************************/
+static void stats_dump(winfo * w){
+	static const char * names[STAGES] = { "epoll_wait", "accept", "setup", "connect", "recv", "send", "close", "sockopt", "offload" };
+	pstats * ps = &w->stats;
+	int st;
+	
+	printf("  %llu wakeups, %llu returned all %d events\n",
+		(unsigned long long)ps->wakeups, (unsigned long long)ps->full, epoll_events);
+	printf("  %-14s %12s %12s\n", "stage", "calls", "avg cycles");
+	for(st = 0; st < STAGES; st++){
+		printf("  %-14s %12llu %12llu\n", names[st], (unsigned long long)ps->calls[st],
+			(unsigned long long)(ps->calls[st] ? ps->cycles[st] / ps->calls[st] : 0));
+	}
+	for(st = 0; st < STAGES; st++){
+		if(ps->calls[st] != 0)
+			stats_hist(names[st], ps->stage_hist[st]);
+	}
+	stats_hist("events/wakeup", ps->events_hist);
+	stats_hist("syscalls/iter", ps->syscalls_hist);
+	stats_hist("bytes/clear", ps->bytes_hist);
+}
+#endif